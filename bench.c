@@ -0,0 +1,1089 @@
+// bench.c
+// Compile: make (or gcc -O2 -march=native -o bench bench.c -lm)
+// One driver for all the experiments. Every benchmark it knows runs one of
+// the programs built next to it in a scratch directory; their numbers end up
+// in a single CSV together with the host they were measured on, and two such
+// files (or a memtest_allsizes statistics CSV as the baseline) are compared.
+//
+// Usage: bench list
+//        bench run [-b name,...] [-s size] [-t threads] [-e engine,...] [-p placement]
+//                  [-r runs] [-o file] [-v]
+//        bench compare [-a alpha] [-m min%] baseline current
+//   list:    the benchmarks and the parameters they take
+//   run:     runs every benchmark (or those of -b) runs times (default 3) and
+//            writes the results to file (default bench_results.csv)
+//   -s, -t, -e, -p: size (bytes, keys or elements), thread count, engines and
+//            placement. A benchmark whose program takes the parameter passes
+//            it on (see list), the others only keep the results that match.
+//   -v:      echo the programs' output to stderr
+//   compare: flags every metric of current that is worse than in baseline by
+//            at least min% (default 5) with a one-sided p below alpha
+//            (default 0.01): Welch's t-test over the runs, or a one-sample
+//            test when one side has a single run. The exit status is 1 when
+//            there is a regression, 2 on errors.
+// Results file: '#' lines with the host (key=value: CPU model, TSC
+// frequency, NUMA layout, huge page state, ...), then
+//   benchmark,size,threads,engine,placement,metric,unit,better,run,value
+// one row per metric and run; better is lower or higher.
+
+#define _GNU_SOURCE // mkdtemp, nftw
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <ctype.h>
+#include <ftw.h>
+#include <glob.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#include "timing.h"
+
+#define FIELD 48  // key fields (benchmark, engine, placement, metric)
+
+static void usage(void) {
+	fprintf(stderr,
+	        "usage: bench list\n"
+	        "       bench run [-b name,...] [-s size] [-t threads] [-e engine,...] [-p placement]"
+	        " [-r runs] [-o file] [-v]\n"
+	        "       bench compare [-a alpha] [-m min%%] baseline current\n");
+}
+
+// Results {{{
+struct record {
+	char benchmark[FIELD];
+	long size;            // bytes, keys or elements; 0: none
+	int threads;
+	char engine[FIELD];
+	char placement[FIELD];
+	char metric[FIELD];
+	char unit[16];
+	int higher_better;
+	int run;
+	double value;
+};
+
+struct results {
+	struct record *records;
+	size_t n, cap;
+};
+
+static void add_record(struct results *res, const struct record *r) {
+	if (res->n == res->cap) {
+		res->cap = res->cap ? 2 * res->cap : 256;
+		res->records = realloc(res->records, res->cap * sizeof(struct record));
+		if (!res->records) {
+			fprintf(stderr, "out of memory\n");
+			exit(2);
+		}
+	}
+	res->records[res->n++] = *r;
+}
+
+static int record_cmp(const void *pa, const void *pb) {
+	const struct record *a = pa, *b = pb;
+	int c;
+	if ((c = strcmp(a->benchmark, b->benchmark)) != 0) {
+		return c;
+	}
+	if (a->size != b->size) {
+		return (a->size < b->size) ? -1 : 1;
+	}
+	if (a->threads != b->threads) {
+		return (a->threads < b->threads) ? -1 : 1;
+	}
+	if ((c = strcmp(a->engine, b->engine)) != 0) {
+		return c;
+	}
+	if ((c = strcmp(a->placement, b->placement)) != 0) {
+		return c;
+	}
+	return strcmp(a->metric, b->metric);
+}
+// }}}
+
+// Host metadata {{{
+static char program_dir[PATH_MAX];  // of the benchmark programs, bench's own
+static int verbose;
+
+// First line of path, without the newline ("" if unreadable)
+static void read_line(const char *path, char *buf, size_t len) {
+	buf[0] = '\0';
+	FILE *f = fopen(path, "r");
+	if (f) {
+		if (fgets(buf, (int)len, f)) {
+			buf[strcspn(buf, "\n")] = '\0';
+		}
+		fclose(f);
+	}
+}
+
+// The [selected] word of a sysfs choice like "always [madvise] never"
+static void selected_choice(const char *path, char *buf, size_t len) {
+	char line[256];
+	read_line(path, line, sizeof(line));
+	char *open = strchr(line, '['), *close = open ? strchr(open, ']') : NULL;
+	if (open && close) {
+		*close = '\0';
+		snprintf(buf, len, "%s", open + 1);
+	} else {
+		snprintf(buf, len, "%s", line[0] ? line : "unknown");
+	}
+}
+
+static void write_host(FILE *f) {
+	char buf[1024], line[512];
+
+	time_t now = time(NULL);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+	fprintf(f, "# date=%s\n", buf);
+	struct utsname u;
+	if (uname(&u) == 0) {
+		fprintf(f, "# kernel=%s %s\n", u.sysname, u.release);
+	}
+	char command[PATH_MAX + 64];
+	snprintf(command, sizeof(command), "git -C '%s' rev-parse --short HEAD 2>/dev/null",
+	         program_dir);
+	FILE *git = popen(command, "r");
+	if (git) {
+		if (fgets(buf, sizeof(buf), git)) {
+			buf[strcspn(buf, "\n")] = '\0';
+			fprintf(f, "# commit=%s\n", buf);
+		}
+		pclose(git);
+	}
+
+	snprintf(buf, sizeof(buf), "unknown");
+	FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+	if (cpuinfo) {
+		while (fgets(line, sizeof(line), cpuinfo)) {
+			if (strncmp(line, "model name", 10) == 0 && strchr(line, ':')) {
+				char *name = strchr(line, ':') + 1;
+				name += strspn(name, " \t");
+				name[strcspn(name, "\n")] = '\0';
+				snprintf(buf, sizeof(buf), "%s", name);
+				break;
+			}
+		}
+		fclose(cpuinfo);
+	}
+	fprintf(f, "# cpu_model=%s\n", buf);
+	fprintf(f, "# cpus=%ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	const char *source;
+	double hz = tsc_hz_from(&source);
+	fprintf(f, "# tsc_hz=%.0f\n# tsc_source=%s\n# tsc_invariant=%s\n", hz, source,
+	        tsc_invariant() ? "yes" : "no");
+
+	// NUMA nodes as node:cpulist, space separated
+	int n_nodes = 0;
+	buf[0] = '\0';
+	for (int node = 0; node < 1024; node++) {
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		if (access(path, R_OK) != 0) {
+			continue;
+		}
+		read_line(path, line, sizeof(line));
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%s%d:%s", n_nodes ? " " : "",
+		         node, line);
+		n_nodes++;
+	}
+	fprintf(f, "# numa_nodes=%d\n# numa_cpus=%s\n", n_nodes, n_nodes ? buf : "");
+
+	selected_choice("/sys/kernel/mm/transparent_hugepage/enabled", buf, sizeof(buf));
+	fprintf(f, "# thp=%s\n", buf);
+	selected_choice("/sys/kernel/mm/transparent_hugepage/defrag", buf, sizeof(buf));
+	fprintf(f, "# thp_defrag=%s\n", buf);
+	read_line("/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages", buf, sizeof(buf));
+	fprintf(f, "# hugepages_2m=%s\n", buf[0] ? buf : "0");
+	read_line("/sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages", buf, sizeof(buf));
+	fprintf(f, "# hugepages_1g=%s\n", buf[0] ? buf : "0");
+}
+// }}}
+
+// Running the programs {{{
+
+// Runs argv[0] of program_dir in the current (work) directory. Its standard
+// output is returned in *out (NUL terminated, to be freed), its standard
+// error goes through. Returns the exit status, -1 if it did not exit.
+static int run_program(char *const argv[], char **out) {
+	char path[PATH_MAX + 64];
+	snprintf(path, sizeof(path), "%s/%s", program_dir, argv[0]);
+	int fds[2];
+	pid_t pid = -1;
+	if (pipe(fds) != 0 || (pid = fork()) < 0) {
+		fprintf(stderr, "cannot start %s: %s\n", argv[0], strerror(errno));
+		*out = calloc(1, 1);
+		return -1;
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		execv(path, argv);
+		fprintf(stderr, "cannot run %s: %s\n", path, strerror(errno));
+		_exit(127);
+	}
+	close(fds[1]);
+	size_t len = 0, cap = 4096;
+	char *text = malloc(cap);
+	ssize_t got;
+	while (text && (got = read(fds[0], text + len, cap - len - 1)) > 0) {
+		len += (size_t)got;
+		if (cap - len < 1024) {
+			cap *= 2;
+			text = realloc(text, cap);
+		}
+	}
+	close(fds[0]);
+	int status;
+	waitpid(pid, &status, 0);
+	if (!text) {
+		fprintf(stderr, "out of memory\n");
+		exit(2);
+	}
+	text[len] = '\0';
+	if (verbose) {
+		fputs(text, stderr);
+	}
+	*out = text;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Whitespace separated table rows under the line whose words are header's
+#define MAX_COLS 8
+#define MAX_ROWS 256
+
+struct row {
+	int n;
+	char col[MAX_COLS][32];
+};
+
+static int split_words(const char *line, size_t len, struct row *r) {
+	r->n = 0;
+	for (size_t i = 0; i < len;) {
+		while (i < len && isspace((unsigned char)line[i])) {
+			i++;
+		}
+		size_t start = i;
+		while (i < len && !isspace((unsigned char)line[i])) {
+			i++;
+		}
+		if (i > start) {
+			if (r->n == MAX_COLS) {
+				return MAX_COLS + 1;
+			}
+			size_t w = (i - start < 31) ? i - start : 31;
+			memcpy(r->col[r->n], line + start, w);
+			r->col[r->n][w] = '\0';
+			r->n++;
+		}
+	}
+	return r->n;
+}
+
+// The rows (as many words as the header) following the header line, up to
+// the first that is not one
+static int parse_table(const char *text, const char *header, struct row *rows, int max_rows) {
+	struct row want, got;
+	split_words(header, strlen(header), &want);
+	int n = 0, in_table = 0;
+	for (const char *line = text; *line && n < max_rows;) {
+		size_t len = strcspn(line, "\n");
+		int words = split_words(line, len, &got);
+		if (in_table) {
+			if (words != want.n) {
+				break;
+			}
+			rows[n++] = got;
+		} else if (words == want.n) {
+			in_table = 1;
+			for (int i = 0; i < want.n; i++) {
+				in_table &= (strcmp(want.col[i], got.col[i]) == 0);
+			}
+		}
+		line += len + (line[len] == '\n');
+	}
+	return n;
+}
+// }}}
+
+// Benchmarks {{{
+// Parameters of a run; size 0, threads 0 and empty strings: not given
+struct params {
+	long size;
+	int threads;
+	char engine[256];
+	char placement[FIELD];
+};
+
+enum { TAKES_SIZE = 1, TAKES_THREADS = 2, TAKES_ENGINE = 4, TAKES_PLACEMENT = 8 };
+
+struct benchmark {
+	const char *name;
+	const char *description;
+	int takes;            // parameters passed to the program, the others filter
+	const char *engines, *placements;
+	int (*run)(const struct params *p, struct record *key, struct results *res);
+};
+
+static const struct params *filter;
+static int filter_takes;
+
+// Whether name is one of the comma-separated list (empty or "all": any)
+static int in_list(const char *list, const char *name) {
+	if (list[0] == '\0' || strcmp(list, "all") == 0) {
+		return 1;
+	}
+	size_t len = strlen(name);
+	for (const char *p = list; *p;) {
+		size_t n = strcspn(p, ",");
+		if (n == len && strncmp(p, name, n) == 0) {
+			return 1;
+		}
+		p += n + (p[n] == ',');
+	}
+	return 0;
+}
+
+// Adds metric of key unless a parameter the program did not take rules it out
+static void emit(struct results *res, const struct record *key, const char *metric,
+                 const char *unit, int higher_better, double value) {
+	if ((!(filter_takes & TAKES_SIZE) && filter->size && key->size != filter->size) ||
+	    (!(filter_takes & TAKES_THREADS) && filter->threads && key->threads != filter->threads) ||
+	    (!(filter_takes & TAKES_ENGINE) && !in_list(filter->engine, key->engine)) ||
+	    (!(filter_takes & TAKES_PLACEMENT) && !in_list(filter->placement, key->placement))) {
+		return;
+	}
+	struct record r = *key;
+	snprintf(r.metric, sizeof(r.metric), "%s", metric);
+	snprintf(r.unit, sizeof(r.unit), "%s", unit);
+	r.higher_better = higher_better;
+	r.value = value;
+	add_record(res, &r);
+}
+
+static void set_key(struct record *key, long size, int threads, const char *engine,
+                    const char *placement) {
+	key->size = size;
+	key->threads = threads;
+	snprintf(key->engine, sizeof(key->engine), "%s", engine);
+	snprintf(key->placement, sizeof(key->placement), "%s", placement);
+}
+
+// memtest_allsizes exponent of size (0: all sizes), -1 if it has none
+static int size_exponent(long size) {
+	static const int exponents[] = {6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 20, 21};
+	if (size == 0) {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(exponents) / sizeof(exponents[0]); i++) {
+		if (size == 1L << exponents[i]) {
+			return exponents[i];
+		}
+	}
+	fprintf(stderr, "memtest_allsizes has no %ld B size\n", size);
+	return -1;
+}
+
+// Page mode of a placement for -H ("" for the default)
+static const char *page_mode(const char *placement) {
+	return placement[0] ? placement : "4k";
+}
+
+// The placement of a memtest_allsizes file label: "_src0_thp" is src0_thp,
+// none is 4k
+static void label_placement(const char *label, char *buf, size_t len) {
+	static const char *pages[][2] = {{"_huge2m", "_2m"}, {"_huge1g", "_1g"}};
+	char tmp[FIELD];
+	snprintf(tmp, sizeof(tmp), "%s", label);
+	for (size_t i = 0; i < sizeof(pages) / sizeof(pages[0]); i++) {
+		char *p = strstr(tmp, pages[i][0]);
+		if (p && p[strlen(pages[i][0])] == '\0') {
+			strcpy(p, pages[i][1]);
+		}
+	}
+	if (tmp[0] == '\0' || (strstr(tmp, "_thp") == NULL && strstr(tmp, "_2m") == NULL &&
+	                       strstr(tmp, "_1g") == NULL)) {
+		snprintf(tmp + strlen(tmp), sizeof(tmp) - strlen(tmp), "_4k");
+	}
+	snprintf(buf, len, "%s", tmp + 1);
+}
+
+// Engine and placement of a memcpy[_<engine>]_performance_statistics<label>.csv
+// name; 0 if it is not one
+static int statistics_name(const char *path, char *engine, char *placement) {
+	const char *base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	const char *stem = strstr(base, "performance_statistics");
+	const char *dot = strrchr(base, '.');
+	if (strncmp(base, "memcpy_", 7) != 0 || !stem || !dot || dot < stem) {
+		return 0;
+	}
+	if (stem == base + 7) {
+		snprintf(engine, FIELD, "libc");
+	} else {
+		snprintf(engine, FIELD, "%.*s", (int)(stem - base - 8), base + 7);
+	}
+	char label[FIELD];
+	const char *after = stem + strlen("performance_statistics");
+	snprintf(label, sizeof(label), "%.*s", (int)(dot - after), after);
+	label_placement(label, placement, FIELD);
+	return 1;
+}
+
+// The size rows of a statistics CSV as memcpy records of key's run
+static int read_statistics(const char *path, struct record *key, struct results *res) {
+	static const struct {
+		int column;
+		const char *metric, *unit;
+	} metrics[] = {
+		{1, "cycles_mean", "cycles"},
+		{5, "cycles_median", "cycles"},
+		{6, "latency_ns_mean", "ns"},
+		{8, "latency_ns_median", "ns"},
+	};
+	char engine[FIELD], placement[FIELD], line[512];
+	FILE *f = fopen(path, "r");
+	if (!f || !statistics_name(path, engine, placement) || !fgets(line, sizeof(line), f) ||
+	    strncmp(line, "size_bytes,cycles_mean,", 23) != 0) {
+		fprintf(stderr, "%s is not a memcpy statistics CSV\n", path);
+		if (f) {
+			fclose(f);
+		}
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		double col[9];
+		char *p = line;
+		int n = 0;
+		for (; n < 9; n++) {
+			char *end;
+			col[n] = strtod(p, &end);
+			if (end == p) {
+				break;
+			}
+			p = end + (*end == ',');
+		}
+		if (n != 9) {
+			continue;
+		}
+		set_key(key, (long)col[0], 1, engine, placement);
+		for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+			emit(res, key, metrics[m].metric, metrics[m].unit, 0, col[metrics[m].column]);
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+// memtest_allsizes [-H mode] exponent engines: the statistics CSVs
+static int run_memcpy(const struct params *p, struct record *key, struct results *res) {
+	int x = size_exponent(p->size);
+	if (x < 0) {
+		return 1;
+	}
+	char exponent[16], *text;
+	snprintf(exponent, sizeof(exponent), "%d", x);
+	char *argv[] = {"memtest_allsizes", "-H", (char *)page_mode(p->placement), exponent,
+	                (char *)(p->engine[0] ? p->engine : "libc"), NULL};
+	int status = run_program(argv, &text);
+	free(text);
+	if (status != 0) {
+		return 1;
+	}
+	glob_t files;
+	if (glob("memcpy*_performance_statistics*.csv", 0, NULL, &files) != 0) {
+		fprintf(stderr, "memtest_allsizes wrote no statistics\n");
+		return 1;
+	}
+	int failed = 0;
+	for (size_t i = 0; i < files.gl_pathc; i++) {
+		failed |= read_statistics(files.gl_pathv[i], key, res);
+		unlink(files.gl_pathv[i]);
+	}
+	globfree(&files);
+	return failed;
+}
+
+// memtest_allsizes -t threads -H mode exponent engines: aggregate GB/s of
+// memcpy_scaling.csv
+static int run_memcpy_scaling(const struct params *p, struct record *key, struct results *res) {
+	int x = size_exponent(p->size ? p->size : 1L << 20);
+	if (x < 0) {
+		return 1;
+	}
+	char exponent[16], threads[16], *text;
+	snprintf(exponent, sizeof(exponent), "%d", x);
+	if (p->threads) {
+		snprintf(threads, sizeof(threads), "%d", p->threads);
+	} else {
+		snprintf(threads, sizeof(threads), "all");
+	}
+	char *argv[] = {"memtest_allsizes", "-t", threads, "-H", (char *)page_mode(p->placement),
+	                exponent, (char *)(p->engine[0] ? p->engine : "libc"), NULL};
+	int status = run_program(argv, &text);
+	free(text);
+	FILE *f = fopen("memcpy_scaling.csv", "r");
+	if (status != 0 || !f) {
+		if (f) {
+			fclose(f);
+		}
+		return 1;
+	}
+	char line[512], engine[FIELD];
+	while (fgets(line, sizeof(line), f)) {
+		// engine,size,threads,thread,cpu,p50,p90,p99,thread_gbps,aggregate_gbps
+		long size;
+		int n_threads, thread;
+		double gbps;
+		if (sscanf(line, "%47[^,],%ld,%d,%d,%*d,%*f,%*f,%*f,%*f,%lf", engine, &size, &n_threads,
+		           &thread, &gbps) == 5 && thread == 0) {
+			set_key(key, size, n_threads, engine, page_mode(p->placement));
+			emit(res, key, "aggregate_gbps", "GB/s", 1, gbps);
+		}
+	}
+	fclose(f);
+	unlink("memcpy_scaling.csv");
+	return 0;
+}
+
+// dram_row_policy -H mode: the median first, second and different row access
+static int run_dram_row(const struct params *p, struct record *key, struct results *res) {
+	static const struct {
+		const char *line, *metric;
+	} metrics[] = {
+		{"First access to row:", "first_access_cycles"},
+		{"Second access to same row:", "second_access_cycles"},
+		{"Access to different row:", "different_row_cycles"},
+	};
+	char *text;
+	char *argv[] = {"dram_row_policy", "-H", (char *)page_mode(p->placement), NULL};
+	int status = run_program(argv, &text);
+	set_key(key, 0, 1, "", page_mode(p->placement));
+	int found = 0;
+	for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]) && status == 0; m++) {
+		const char *line = strstr(text, metrics[m].line);
+		double median;
+		if (line && sscanf(line + strlen(metrics[m].line), " %*f cycles / %lf", &median) == 1) {
+			emit(res, key, metrics[m].metric, "cycles", 0, median);
+			found++;
+		}
+	}
+	free(text);
+	return found == 3 ? 0 : 1;
+}
+
+// hashmap bench: ns per lookup of both layouts by key count
+static int run_hashmap(const struct params *p, struct record *key, struct results *res) {
+	static struct row rows[MAX_ROWS];
+	char *text;
+	char *argv[] = {"hashmap", "bench", NULL};
+	(void)p;
+	int status = run_program(argv, &text);
+	int n = parse_table(text, "keys inline_KiB inline_ns legacy_ns speedup", rows, MAX_ROWS);
+	free(text);
+	for (int i = 0; i < n; i++) {
+		set_key(key, atol(rows[i].col[0]), 1, "inline", "");
+		emit(res, key, "ns_per_lookup", "ns", 0, atof(rows[i].col[2]));
+		set_key(key, atol(rows[i].col[0]), 1, "legacy", "");
+		emit(res, key, "ns_per_lookup", "ns", 0, atof(rows[i].col[3]));
+	}
+	return (status == 0 && n > 0) ? 0 : 1;
+}
+
+// hashmap batch: lookups/s of search() and search_batch() by batch size
+static int run_hashmap_batch(const struct params *p, struct record *key, struct results *res) {
+	static struct row rows[MAX_ROWS];
+	char *text;
+	char *argv[] = {"hashmap", "batch", NULL};
+	(void)p;
+	int status = run_program(argv, &text);
+	long keys = 0;
+	const char *line = strstr(text, " keys, ");
+	if (line) {
+		while (line > text && isdigit((unsigned char)line[-1])) {
+			line--;
+		}
+		keys = atol(line);
+	}
+	int n = parse_table(text, "batch Mlookups/s speedup", rows, MAX_ROWS);
+	free(text);
+	for (int i = 0; i < n; i++) {
+		char engine[FIELD];
+		if (isdigit((unsigned char)rows[i].col[0][0])) {
+			snprintf(engine, sizeof(engine), "batch%s", rows[i].col[0]);
+		} else {
+			snprintf(engine, sizeof(engine), "%s", rows[i].col[0]);
+		}
+		set_key(key, keys, 1, engine, "");
+		emit(res, key, "mlookups_per_s", "Mlookups/s", 1, atof(rows[i].col[1]));
+	}
+	return (status == 0 && n > 0) ? 0 : 1;
+}
+
+// hashmap concurrent threads: Mops/s by read percentage and thread count
+static int run_hashmap_concurrent(const struct params *p, struct record *key,
+                                  struct results *res) {
+	static struct row rows[MAX_ROWS];
+	char threads[16], *text;
+	snprintf(threads, sizeof(threads), "%d",
+	         p->threads ? p->threads : (int)sysconf(_SC_NPROCESSORS_ONLN));
+	char *argv[] = {"hashmap", "concurrent", threads, NULL};
+	int status = run_program(argv, &text);
+	int n = parse_table(text, "reads% threads Mops/s", rows, MAX_ROWS);
+	free(text);
+	for (int i = 0; i < n; i++) {
+		char metric[FIELD];
+		snprintf(metric, sizeof(metric), "mops_reads%s", rows[i].col[0]);
+		set_key(key, 0, atoi(rows[i].col[1]), "concurrent", "");
+		emit(res, key, metric, "Mops/s", 1, atof(rows[i].col[2]));
+	}
+	return (status == 0 && n > 0) ? 0 : 1;
+}
+
+// linkedlist bench: ns per element of a scan, by node placement
+static int run_linkedlist(const struct params *p, struct record *key, struct results *res) {
+	static const char *placements[] = {"scattered", "arena", "unrolled"};
+	static struct row rows[MAX_ROWS];
+	char *text;
+	char *argv[] = {"linkedlist", "bench", NULL};
+	(void)p;
+	int status = run_program(argv, &text);
+	int n = parse_table(text, "elements nodes_KiB scattered_ns arena_ns unrolled_ns", rows,
+	                    MAX_ROWS);
+	free(text);
+	for (int i = 0; i < n; i++) {
+		for (int c = 0; c < 3; c++) {
+			set_key(key, atol(rows[i].col[0]), 1, "", placements[c]);
+			emit(res, key, "ns_per_element", "ns", 0, atof(rows[i].col[2 + c]));
+		}
+	}
+	return (status == 0 && n > 0) ? 0 : 1;
+}
+
+static const struct benchmark benchmarks[] = {
+	{"memcpy", "memtest_allsizes: copy latency by size, flushed buffers",
+	 TAKES_SIZE | TAKES_ENGINE | TAKES_PLACEMENT,
+	 "libc,sse2,avx2,avx512,erms,nt,all", "4k,thp,2m,1g", run_memcpy},
+	{"memcpy_scaling", "memtest_allsizes -t: aggregate copy bandwidth by thread count (1 MiB)",
+	 TAKES_SIZE | TAKES_THREADS | TAKES_ENGINE | TAKES_PLACEMENT,
+	 "libc,sse2,avx2,avx512,erms,nt,all", "4k,thp,2m,1g", run_memcpy_scaling},
+	{"dram_row", "dram_row_policy: first/second/different row access latency",
+	 TAKES_PLACEMENT, "", "4k,thp,2m,1g", run_dram_row},
+	{"hashmap", "hashmap bench: lookup latency by key count", 0, "inline,legacy", "",
+	 run_hashmap},
+	{"hashmap_batch", "hashmap batch: search_batch() throughput by batch size", 0,
+	 "search,batch<n>", "", run_hashmap_batch},
+	{"hashmap_concurrent", "hashmap concurrent: throughput by read ratio and threads",
+	 TAKES_THREADS, "concurrent", "", run_hashmap_concurrent},
+	{"linkedlist", "linkedlist bench: scan latency by element count", 0, "",
+	 "scattered,arena,unrolled", run_linkedlist},
+};
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int list_benchmarks(void) {
+	printf("%-20s %-8s %s\n", "benchmark", "takes", "description");
+	for (size_t i = 0; i < N_BENCHMARKS; i++) {
+		const struct benchmark *b = &benchmarks[i];
+		printf("%-20s %c%c%c%c     %s\n", b->name, (b->takes & TAKES_SIZE) ? 's' : '-',
+		       (b->takes & TAKES_THREADS) ? 't' : '-', (b->takes & TAKES_ENGINE) ? 'e' : '-',
+		       (b->takes & TAKES_PLACEMENT) ? 'p' : '-', b->description);
+		if (b->engines[0]) {
+			printf("%-20s          engines: %s\n", "", b->engines);
+		}
+		if (b->placements[0]) {
+			printf("%-20s          placements: %s\n", "", b->placements);
+		}
+	}
+	return 0;
+}
+// }}}
+
+// Run {{{
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+static void write_results(FILE *f, const struct results *res) {
+	fprintf(f, "benchmark,size,threads,engine,placement,metric,unit,better,run,value\n");
+	for (size_t i = 0; i < res->n; i++) {
+		const struct record *r = &res->records[i];
+		fprintf(f, "%s,%ld,%d,%s,%s,%s,%s,%s,%d,%.6g\n", r->benchmark, r->size, r->threads,
+		        r->engine, r->placement, r->metric, r->unit,
+		        r->higher_better ? "higher" : "lower", r->run, r->value);
+	}
+}
+
+static int run(int argc, char **argv) {
+	static struct params p;
+	const char *selected = "", *output = "bench_results.csv";
+	int runs = 3, opt;
+	while ((opt = getopt(argc, argv, "b:s:t:e:p:r:o:v")) != -1) {
+		switch (opt) {
+		case 'b':
+			selected = optarg;
+			break;
+		case 's':
+			p.size = atol(optarg);
+			break;
+		case 't':
+			p.threads = atoi(optarg);
+			break;
+		case 'e':
+			snprintf(p.engine, sizeof(p.engine), "%s", optarg);
+			break;
+		case 'p':
+			snprintf(p.placement, sizeof(p.placement), "%s", optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (runs < 1) {
+		fprintf(stderr, "-r needs at least one run\n");
+		return 2;
+	}
+	for (const char *s = selected; *s;) {
+		size_t n = strcspn(s, ",");
+		int known = 0;
+		for (size_t i = 0; i < N_BENCHMARKS; i++) {
+			known |= (strlen(benchmarks[i].name) == n && strncmp(benchmarks[i].name, s, n) == 0);
+		}
+		if (!known) {
+			fprintf(stderr, "unknown benchmark %.*s (see bench list)\n", (int)n, s);
+			return 2;
+		}
+		s += n + (s[n] == ',');
+	}
+
+	ssize_t len = readlink("/proc/self/exe", program_dir, sizeof(program_dir) - 1);
+	if (len <= 0) {
+		fprintf(stderr, "cannot find the benchmark programs\n");
+		return 2;
+	}
+	program_dir[len] = '\0';
+	*strrchr(program_dir, '/') = '\0';
+
+	FILE *f = fopen(output, "w");
+	if (!f) {
+		fprintf(stderr, "failed to open %s for writing\n", output);
+		return 2;
+	}
+	print_calibration();
+	fflush(stdout);
+	write_host(f);
+	// The programs write their CSVs to the current directory
+	char work[] = "/tmp/bench.XXXXXX";
+	if (!mkdtemp(work) || chdir(work) != 0) {
+		fprintf(stderr, "cannot make a work directory: %s\n", strerror(errno));
+		return 2;
+	}
+
+	static struct results res;
+	int failed = 0;
+	for (size_t i = 0; i < N_BENCHMARKS; i++) {
+		const struct benchmark *b = &benchmarks[i];
+		if (!in_list(selected, b->name)) {
+			continue;
+		}
+		filter = &p;
+		filter_takes = b->takes;
+		for (int r = 0; r < runs; r++) {
+			fprintf(stderr, "%s: run %d of %d\n", b->name, r + 1, runs);
+			struct record key;
+			memset(&key, 0, sizeof(key));
+			snprintf(key.benchmark, sizeof(key.benchmark), "%s", b->name);
+			key.run = r;
+			if (b->run(&p, &key, &res) != 0) {
+				fprintf(stderr, "%s failed (run with -v for its output)\n", b->name);
+				failed = 1;
+				break;
+			}
+		}
+	}
+
+	write_results(f, &res);
+	fclose(f);
+	nftw(work, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	fprintf(stderr, "Wrote %zu results: %s\n", res.n, output);
+	return failed ? 2 : 0;
+}
+// }}}
+
+// Compare {{{
+struct host {
+	char cpu_model[1024];
+	char tsc_hz[1024];
+};
+
+// Reads a results file, or a memtest_allsizes statistics CSV as one run of
+// the memcpy benchmark
+static int load(const char *path, struct results *res, struct host *host) {
+	static const struct params none;
+	char line[1024] = "";
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "failed to open %s\n", path);
+		return 1;
+	}
+	memset(host, 0, sizeof(*host));
+	while (fgets(line, sizeof(line), f) && line[0] == '#') {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, "# cpu_model=", 12) == 0) {
+			snprintf(host->cpu_model, sizeof(host->cpu_model), "%s", line + 12);
+		} else if (strncmp(line, "# tsc_hz=", 9) == 0) {
+			snprintf(host->tsc_hz, sizeof(host->tsc_hz), "%s", line + 9);
+		}
+	}
+	filter = &none;
+	filter_takes = 0;
+	if (strncmp(line, "size_bytes,", 11) == 0) {
+		fclose(f);
+		struct record key;
+		memset(&key, 0, sizeof(key));
+		snprintf(key.benchmark, sizeof(key.benchmark), "memcpy");
+		return read_statistics(path, &key, res);
+	}
+	if (strncmp(line, "benchmark,size,threads,", 23) != 0) {
+		fprintf(stderr, "%s is neither a bench results file nor a statistics CSV\n", path);
+		fclose(f);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		struct record r;
+		char better[16];
+		memset(&r, 0, sizeof(r));
+		// the string fields may be empty, so split by hand
+		char *field[10];
+		int n = 0;
+		line[strcspn(line, "\n")] = '\0';
+		for (char *s = line; n < 10; n++) {
+			field[n] = s;
+			s = strchr(s, ',');
+			if (!s) {
+				n++;
+				break;
+			}
+			*s++ = '\0';
+		}
+		if (n != 10) {
+			continue;
+		}
+		snprintf(r.benchmark, sizeof(r.benchmark), "%s", field[0]);
+		r.size = atol(field[1]);
+		r.threads = atoi(field[2]);
+		snprintf(r.engine, sizeof(r.engine), "%s", field[3]);
+		snprintf(r.placement, sizeof(r.placement), "%s", field[4]);
+		snprintf(r.metric, sizeof(r.metric), "%s", field[5]);
+		snprintf(r.unit, sizeof(r.unit), "%s", field[6]);
+		snprintf(better, sizeof(better), "%s", field[7]);
+		r.higher_better = (strcmp(better, "higher") == 0);
+		r.run = atoi(field[8]);
+		r.value = atof(field[9]);
+		add_record(res, &r);
+	}
+	fclose(f);
+	return 0;
+}
+
+// Regularized incomplete beta function I_x(a, b) by its continued fraction
+// (modified Lentz), accurate where x < (a + 1) / (a + b + 2)
+static double beta_fraction(double a, double b, double x) {
+	const double tiny = 1e-300;
+	double c = 1, d = 1 - (a + b) * x / (a + 1);
+	d = 1 / (fabs(d) < tiny ? tiny : d);
+	double h = d;
+	for (int m = 1; m <= 300; m++) {
+		for (int odd = 0; odd <= 1; odd++) {
+			double num = odd ? -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1))
+			                 : m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m));
+			d = 1 + num * d;
+			d = 1 / (fabs(d) < tiny ? tiny : d);
+			c = 1 + num / c;
+			c = fabs(c) < tiny ? tiny : c;
+			h *= c * d;
+			if (odd && fabs(c * d - 1) < 1e-12) {
+				return h;
+			}
+		}
+	}
+	return h;
+}
+
+static double incomplete_beta(double a, double b, double x) {
+	if (x <= 0 || x >= 1) {
+		return x <= 0 ? 0 : 1;
+	}
+	double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log1p(-x));
+	if (x < (a + 1) / (a + b + 2)) {
+		return front * beta_fraction(a, b, x) / a;
+	}
+	return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+// P(T >= t) for Student's t with df degrees of freedom
+static double t_tail(double t, double df) {
+	double tail = 0.5 * incomplete_beta(df / 2, 0.5, df / (df + t * t));
+	return t > 0 ? tail : 1 - tail;
+}
+
+struct sample {
+	int n;
+	double mean, var;
+};
+
+static struct sample describe(const struct record *r, size_t n) {
+	struct sample s = {(int)n, 0, 0};
+	for (size_t i = 0; i < n; i++) {
+		s.mean += r[i].value;
+	}
+	s.mean /= n;
+	for (size_t i = 0; i < n; i++) {
+		s.var += (r[i].value - s.mean) * (r[i].value - s.mean);
+	}
+	s.var = (n > 1) ? s.var / (n - 1) : 0;
+	return s;
+}
+
+// One-sided p that current is worse than baseline by diff (> 0 when worse):
+// Welch's t-test, or a one-sample test against the side with a single run.
+// NAN when neither side has two runs.
+static double worse_p(struct sample base, struct sample cur, double diff) {
+	double se2, df;
+	if (base.n > 1 && cur.n > 1) {
+		double vb = base.var / base.n, vc = cur.var / cur.n;
+		se2 = vb + vc;
+		df = se2 * se2 / (vb * vb / (base.n - 1) + vc * vc / (cur.n - 1));
+	} else if (base.n > 1 || cur.n > 1) {
+		const struct sample *s = (base.n > 1) ? &base : &cur;
+		se2 = s->var / s->n;
+		df = s->n - 1;
+	} else {
+		return NAN;
+	}
+	if (se2 <= 0) {
+		return diff > 0 ? 0 : 1;
+	}
+	return t_tail(diff / sqrt(se2), isfinite(df) ? df : 1e6);
+}
+
+static int compare(int argc, char **argv) {
+	double alpha = 0.01, min_change = 0.05;
+	int opt;
+	while ((opt = getopt(argc, argv, "a:m:")) != -1) {
+		switch (opt) {
+		case 'a':
+			alpha = atof(optarg);
+			break;
+		case 'm':
+			min_change = atof(optarg) / 100.0;
+			break;
+		default:
+			usage();
+			return 2;
+		}
+	}
+	if (argc - optind != 2) {
+		fprintf(stderr, "compare needs a baseline and a current results file\n");
+		return 2;
+	}
+	static struct results base, cur;
+	struct host base_host, cur_host;
+	if (load(argv[optind], &base, &base_host) != 0 ||
+	    load(argv[optind + 1], &cur, &cur_host) != 0) {
+		return 2;
+	}
+	// A measured TSC frequency differs a little from run to run
+	double base_hz = atof(base_host.tsc_hz), cur_hz = atof(cur_host.tsc_hz);
+	if (base_host.cpu_model[0] && cur_host.cpu_model[0] &&
+	    (strcmp(base_host.cpu_model, cur_host.cpu_model) != 0 ||
+	     fabs(base_hz - cur_hz) > 0.01 * cur_hz)) {
+		fprintf(stderr, "warning: the baseline ran on %s (TSC %s Hz), this on %s (TSC %s Hz)\n",
+		        base_host.cpu_model, base_host.tsc_hz, cur_host.cpu_model, cur_host.tsc_hz);
+	}
+	qsort(base.records, base.n, sizeof(struct record), record_cmp);
+	qsort(cur.records, cur.n, sizeof(struct record), record_cmp);
+
+	printf("%-18s %9s %3s %-10s %-10s %-20s %12s %12s %8s %8s  %s\n", "benchmark", "size", "thr",
+	       "engine", "placement", "metric", "baseline", "current", "change", "p", "verdict");
+	int regressions = 0, improvements = 0, compared = 0, only_base = 0, only_cur = 0;
+	size_t i = 0, j = 0;
+	while (i < base.n || j < cur.n) {
+		int c = (i == base.n) ? 1 : (j == cur.n) ? -1 : record_cmp(&base.records[i], &cur.records[j]);
+		size_t bi = i, cj = j;
+		while (i < base.n && (c <= 0) && record_cmp(&base.records[i], &base.records[bi]) == 0) {
+			i++;
+		}
+		while (j < cur.n && (c >= 0) && record_cmp(&cur.records[j], &cur.records[cj]) == 0) {
+			j++;
+		}
+		if (c != 0) {
+			only_base += (c < 0);
+			only_cur += (c > 0);
+			continue;
+		}
+		const struct record *r = &cur.records[cj];
+		struct sample sb = describe(&base.records[bi], i - bi), sc = describe(r, j - cj);
+		double diff = r->higher_better ? sb.mean - sc.mean : sc.mean - sb.mean;
+		double change = sb.mean != 0 ? (sc.mean - sb.mean) / fabs(sb.mean) : 0;
+		double p = worse_p(sb, sc, diff);
+		double p_better = isnan(p) ? NAN : worse_p(sb, sc, -diff);
+		const char *verdict = "ok";
+		if (isnan(p)) {
+			verdict = (fabs(change) >= min_change) ? "untested (single runs)" : "ok";
+		} else if (diff > 0 && fabs(change) >= min_change && p < alpha) {
+			verdict = "REGRESSION";
+			regressions++;
+		} else if (diff < 0 && fabs(change) >= min_change && p_better < alpha) {
+			verdict = "improvement";
+			improvements++;
+		}
+		compared++;
+		printf("%-18s %9ld %3d %-10s %-10s %-20s %12.4g %12.4g %+7.1f%% %8.2g  %s\n",
+		       r->benchmark, r->size, r->threads, r->engine[0] ? r->engine : "-",
+		       r->placement[0] ? r->placement : "-", r->metric, sb.mean, sc.mean, 100 * change,
+		       isnan(p) ? NAN : (diff > 0 ? p : p_better), verdict);
+	}
+	printf("\n%d metrics compared: %d regressions, %d improvements (at least %.1f%%, p < %g)",
+	       compared, regressions, improvements, 100 * min_change, alpha);
+	if (only_base || only_cur) {
+		printf("; %d only in the baseline, %d only in the current results", only_base, only_cur);
+	}
+	printf("\n");
+	return regressions ? 1 : 0;
+}
+// }}}
+
+int main(int argc, char **argv) {
+	if (argc < 2 || strcmp(argv[1], "list") == 0) {
+		return list_benchmarks();
+	}
+	if (strcmp(argv[1], "run") == 0) {
+		return run(argc - 1, argv + 1);
+	}
+	if (strcmp(argv[1], "compare") == 0) {
+		return compare(argc - 1, argv + 1);
+	}
+	usage();
+	return 2;
+}
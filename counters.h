@@ -0,0 +1,300 @@
+// counters.h
+// Hardware performance counters around a measured region (-P), shared by
+// memtest_allsizes.c and dram_row_policy.c. Core events (LLC misses, dTLB
+// load misses, memory stall cycles) are opened for this thread in user space
+// only, so perf_event_paranoid <= 2 is enough, as one group read with rdpmc
+// from their mmap'd pages: tens of cycles per read, taken outside the rdtsc
+// window. DRAM CAS counts come from the uncore IMC PMUs when the kernel
+// exports them; those are system wide, read with read() and need
+// perf_event_paranoid <= 0 or CAP_PERFMON. Whatever cannot be opened is
+// reported and left out.
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PMC_MAX 8
+#define PMC_MAX_FDS 64
+
+struct pmc {
+	char name[32];
+	int n_fds; // uncore: one per memory controller and listed CPU, summed
+	int fd[PMC_MAX_FDS];
+	struct perf_event_mmap_page *page; // core events, for rdpmc
+};
+
+struct pmc_set {
+	int n;
+	int leader; // group leader fd of the core events (-1: none yet)
+	struct pmc pmc[PMC_MAX];
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int pid, int cpu, int group_fd) {
+	return (int)syscall(SYS_perf_event_open, attr, pid, cpu, group_fd, 0);
+}
+
+static inline uint64_t rdpmc(uint32_t counter) {
+	uint32_t lo, hi;
+	asm volatile("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// Opens a core event of this thread into the group
+static int pmc_add(struct pmc_set *s, const char *name, uint32_t type, uint64_t config) {
+	if (s->n == PMC_MAX) {
+		return 0;
+	}
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	int fd = perf_event_open(&attr, 0, -1, s->leader);
+	if (fd < 0) {
+		fprintf(stderr, "counter %s unavailable: %s\n", name, strerror(errno));
+		return 0;
+	}
+	struct pmc *p = &s->pmc[s->n++];
+	snprintf(p->name, sizeof(p->name), "%s", name);
+	p->n_fds = 1;
+	p->fd[0] = fd;
+	p->page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if (p->page == MAP_FAILED) {
+		p->page = NULL;
+	}
+	if (s->leader < 0) {
+		s->leader = fd;
+	}
+	return 1;
+}
+
+// Reads a whole sysfs file into buf (0 if there is none)
+static int read_sysfs(const char *path, char *buf, size_t len) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	size_t n = fread(buf, 1, len - 1, f);
+	buf[n] = '\0';
+	fclose(f);
+	return n > 0;
+}
+
+// config of a named event of a sysfs PMU, e.g. "event=0x04,umask=0x03" with
+// format/event "config:0-7" and format/umask "config:8-15"
+static int sysfs_event_config(const char *pmu, const char *event, uint64_t *config) {
+	char path[512], spec[256];
+	snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/events/%s", pmu, event);
+	if (!read_sysfs(path, spec, sizeof(spec))) {
+		return 0;
+	}
+	*config = 0;
+	for (char *term = strtok(spec, ",\n"); term; term = strtok(NULL, ",\n")) {
+		char *eq = strchr(term, '=');
+		uint64_t value = eq ? strtoull(eq + 1, NULL, 0) : 1;
+		if (eq) {
+			*eq = '\0';
+		}
+		char format[64];
+		unsigned lo;
+		snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/format/%s", pmu, term);
+		if (!read_sysfs(path, format, sizeof(format)) || sscanf(format, "config:%u", &lo) != 1) {
+			return 0;
+		}
+		*config |= value << lo;
+	}
+	return 1;
+}
+
+// CPUs of a sysfs list such as "0,28" or "0-3,8" into cpus, at most max
+static int parse_cpu_list(const char *text, int *cpus, int max) {
+	int n = 0;
+	while (*text && n < max) {
+		char *end;
+		long lo = strtol(text, &end, 10);
+		if (end == text) {
+			break;
+		}
+		long hi = lo;
+		if (*end == '-') {
+			text = end + 1;
+			hi = strtol(text, &end, 10);
+		}
+		for (long cpu = lo; cpu <= hi && n < max; cpu++) {
+			cpus[n++] = (int)cpu;
+		}
+		text = (*end == ',') ? end + 1 : end;
+	}
+	return n;
+}
+
+// Opens event on every uncore_imc PMU, on each CPU of its cpumask (one per
+// socket), as one summed counter
+static void pmc_add_uncore(struct pmc_set *s, const char *name, const char *event) {
+	DIR *dir = opendir("/sys/bus/event_source/devices");
+	if (!dir || s->n == PMC_MAX) {
+		if (dir) {
+			closedir(dir);
+		}
+		return;
+	}
+	struct pmc *p = &s->pmc[s->n];
+	p->n_fds = 0;
+	p->page = NULL;
+	struct dirent *entry;
+	int found = 0;
+	while ((entry = readdir(dir)) && p->n_fds < PMC_MAX_FDS) {
+		if (strncmp(entry->d_name, "uncore_imc", 10) != 0) {
+			continue;
+		}
+		found = 1;
+		char path[512], text[256];
+		uint64_t config;
+		snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/type", entry->d_name);
+		if (!read_sysfs(path, text, sizeof(text)) || !sysfs_event_config(entry->d_name, event, &config)) {
+			continue;
+		}
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = (uint32_t)atoi(text);
+		attr.config = config;
+		snprintf(path, sizeof(path), "/sys/bus/event_source/devices/%s/cpumask", entry->d_name);
+		int cpus[PMC_MAX_FDS], n_cpus = 0;
+		if (read_sysfs(path, text, sizeof(text))) {
+			n_cpus = parse_cpu_list(text, cpus, PMC_MAX_FDS - p->n_fds);
+		}
+		if (n_cpus == 0) {
+			cpus[n_cpus++] = 0;
+		}
+		for (int c = 0; c < n_cpus; c++) {
+			int fd = perf_event_open(&attr, -1, cpus[c], -1);
+			if (fd < 0) {
+				fprintf(stderr, "counter %s on %s cpu %d unavailable: %s\n", name, entry->d_name,
+				        cpus[c], strerror(errno));
+				continue;
+			}
+			p->fd[p->n_fds++] = fd;
+		}
+	}
+	closedir(dir);
+	if (p->n_fds > 0) {
+		snprintf(p->name, sizeof(p->name), "%s", name);
+		s->n++;
+	} else if (!found) {
+		fprintf(stderr, "counter %s unavailable: no uncore_imc PMU\n", name);
+	}
+}
+
+// The default set: LLC and dTLB load misses, memory stall cycles (the generic
+// backend stalls, else CYCLE_ACTIVITY.STALLS_L3_MISS on Intel) and DRAM CAS
+// reads and writes
+static void pmc_open(struct pmc_set *s) {
+	s->n = 0;
+	s->leader = -1;
+	pmc_add(s, "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	pmc_add(s, "dtlb_load_misses", PERF_TYPE_HW_CACHE,
+	        PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	if (!pmc_add(s, "stall_cycles_mem", PERF_TYPE_HARDWARE, PERF_COUNT_HW_STALLED_CYCLES_BACKEND)) {
+		unsigned a, b = 0, c, d;
+		__get_cpuid(0, &a, &b, &c, &d);
+		if (b == 0x756e6547) { // "Genu"ineIntel
+			pmc_add(s, "stall_cycles_l3_miss", PERF_TYPE_RAW, 0xa3 | (0x06 << 8) | (6ULL << 24));
+		}
+	}
+	pmc_add_uncore(s, "dram_cas_reads", "cas_count_read");
+	pmc_add_uncore(s, "dram_cas_writes", "cas_count_write");
+
+	printf("Counters:");
+	for (int i = 0; i < s->n; i++) {
+		printf(" %s%s", s->pmc[i].name,
+		       (s->pmc[i].page && s->pmc[i].page->cap_user_rdpmc) ? "" : " (read)");
+	}
+	printf("%s\n", s->n ? "" : " none");
+}
+
+static inline uint64_t pmc_value(const struct pmc *p) {
+	struct perf_event_mmap_page *pc = p->page;
+	if (pc && pc->cap_user_rdpmc) {
+		uint32_t seq, index;
+		uint64_t count;
+		do {
+			seq = pc->lock;
+			asm volatile("" ::: "memory");
+			index = pc->index;
+			count = pc->offset;
+			if (index) {
+				int shift = 64 - pc->pmc_width;
+				count += (uint64_t)((int64_t)(rdpmc(index - 1) << shift) >> shift);
+			}
+			asm volatile("" ::: "memory");
+		} while (pc->lock != seq);
+		if (index) {
+			return count;
+		}
+	}
+	uint64_t sum = 0;
+	for (int i = 0; i < p->n_fds; i++) {
+		uint64_t value = 0;
+		if (read(p->fd[i], &value, sizeof(value)) == sizeof(value)) {
+			sum += value;
+		}
+	}
+	return sum;
+}
+
+static inline void pmc_read(const struct pmc_set *s, uint64_t *values) {
+	for (int i = 0; i < s->n; i++) {
+		values[i] = pmc_value(&s->pmc[i]);
+	}
+}
+
+static void pmc_close(struct pmc_set *s) {
+	for (int i = 0; i < s->n; i++) {
+		if (s->pmc[i].page) {
+			munmap(s->pmc[i].page, sysconf(_SC_PAGESIZE));
+		}
+		for (int j = 0; j < s->pmc[i].n_fds; j++) {
+			close(s->pmc[i].fd[j]);
+		}
+	}
+	s->n = 0;
+}
+
+// Mean counter deltas (n trials, s->n per trial after deltas[t * s->n]) of
+// the trials slower than fence cycles against the others
+static void pmc_attribute(const struct pmc_set *s, const uint64_t *cycles, const uint64_t *deltas,
+                          size_t n, double fence) {
+	long double slow[PMC_MAX] = {0}, normal[PMC_MAX] = {0};
+	size_t n_slow = 0;
+	for (size_t t = 0; t < n; t++) {
+		long double *sum = ((double)cycles[t] > fence) ? slow : normal;
+		n_slow += (double)cycles[t] > fence;
+		for (int i = 0; i < s->n; i++) {
+			sum[i] += (long double)deltas[t * s->n + i];
+		}
+	}
+	printf("  %zu of %zu trials above %.0f cycles; mean per trial, outliers vs the rest:\n",
+	       n_slow, n, fence);
+	for (int i = 0; i < s->n; i++) {
+		printf("    %-22s %12.2Lf %12.2Lf\n", s->pmc[i].name,
+		       n_slow ? slow[i] / (long double)n_slow : 0.0L,
+		       (n > n_slow) ? normal[i] / (long double)(n - n_slow) : 0.0L);
+	}
+}
+
+#endif
@@ -1,63 +1,90 @@
 // dram_row_policy.c
-// Compile: gcc -O2 -march=native -o dram_row_policy dram_row_policy.c
+// Compile: gcc -O2 -march=native -o dram_row_policy dram_row_policy.c -lm
+//
+// Usage: dram_row_policy [-n node] [-c cpu] [-H 4k|thp|2m|1g] [-M] [-P] [-e ci%]
+//                        [-A] [-B k] [-F] [-S MiB]
+//   -n: bind both rows to a NUMA node
+//   -H: back the rows with 4 KiB, transparent huge or 2 MiB / 1 GiB pages,
+//       which takes the page walk out of the first access
+//   -c: pin the measuring thread to a CPU
+//   -M: first-access latency matrix over all (CPU node, memory node) pairs
+//   -P: read hardware performance counters around every access (see
+//       counters.h), report their mean per access and compare the slow
+//       first accesses with the rest
+//   -A: characterize the DRAM behind a huge page pool instead: bank address
+//       functions, row and column bits, and row hit / miss / conflict latency
+//       per bank (dram_mapping.csv, dram_bank_latency.csv); 4 KiB pages
+//       become transparent huge pages
+//   -B: bank parallelism on the -A mapping: up to k loads in flight to
+//       distinct banks and to one bank, batched and as pointer chases, with
+//       the achieved MLP and bandwidth (dram_bank_parallelism.csv)
+//   -F: refresh interference: a million DRAM loads in a row, the slow ones
+//       and their period (dram_refresh_spikes.csv)
+//   -S: pool size for -A and -B in MiB (default 512)
+//   -e: iterate until the first access median's 95% confidence interval is
+//       within ci% of it (default 0.5, at most TEST_ITERATIONS or 2 s);
+//       0 runs all TEST_ITERATIONS
+// Cycles are TSC ticks minus the calibrated timer overhead, see timing.h.
 
+#define _GNU_SOURCE // sched_setaffinity, CPU_SET
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <math.h>
 #include <sys/mman.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "timing.h"
+#include "counters.h"
+#include "placement.h"
 
 #define ROW_SIZE (8 * 1024)  // Typical DRAM row size: 8KB
 #define TEST_ITERATIONS 100000
 
-// Flush one cache line
-static inline void clflush_line(void* p) {
-    asm volatile("clflush (%0)" :: "r"(p));
-}
-
-// Serialized rdtsc
-static inline uint64_t rdtsc_start(void) {
-    unsigned hi, lo;
-    asm volatile(
-        "cpuid\n\t"
-        "rdtsc\n\t"
-        : "=a"(lo), "=d"(hi)
-        : "a"(0)
-        : "rbx", "rcx");
-    return ((uint64_t)hi << 32) | lo;
-}
-
-static inline uint64_t rdtsc_end(void) {
-    unsigned hi, lo;
-    asm volatile(
-        "rdtscp\n\t"
-        "mov %%eax, %0\n\t"
-        "mov %%edx, %1\n\t"
-        "cpuid\n\t"
-        : "=r"(lo), "=r"(hi)
-        :
-        : "rax", "rbx", "rcx", "rdx");
-    return ((uint64_t)hi << 32) | lo;
-}
-
-// Flush entire buffer
-void flush_buffer(void* buf, size_t size) {
-    const size_t line = 64;
-    volatile char* p = (volatile char*)buf;
-    for (size_t off = 0; off < size; off += line) {
-        clflush_line((void*)(p + off));
+static struct histogram first_access;
+static struct histogram second_access;
+static struct histogram different_row_access;
+
+// Relative half width of the first access median's confidence interval to
+// stop at (-e)
+static double ci_target = 0.005;
+
+// Performance counters read around every access (-P, empty without), with
+// the first accesses' cycles and counter deltas per iteration
+static struct pmc_set pmcs;
+static uint64_t* first_cycles;
+static uint64_t* first_deltas;
+
+typedef struct {
+    long double first;
+    long double second;
+    long double different_row;
+    uint64_t first_median;
+    uint64_t second_median;
+    uint64_t different_row_median;
+    size_t iterations;
+    // Mean counter deltas per first, second and different row access
+    long double counters[3][PMC_MAX];
+} row_means;
+
+// Adds the counter deltas between before and after to sums
+static void add_deltas(long double* sums, const uint64_t* before, const uint64_t* after) {
+    for (int c = 0; c < pmcs.n; c++) {
+        sums[c] += (long double)(after[c] - before[c]);
     }
-    asm volatile("mfence" ::: "memory");
 }
 
-int main() {
-    printf("Testing DRAM Row Buffer Policy (Row Size: %d bytes)\n", ROW_SIZE);
-
+// Runs the test iterations on two rows allocated on node
+static int measure_rows(int node, row_means* means) {
     // Allocate memory for two rows
-    void* row1, * row2;
-    if (posix_memalign(&row1, 64, ROW_SIZE) != 0 ||
-        posix_memalign(&row2, 64, ROW_SIZE) != 0) {
+    void* row1 = alloc_buffer(ROW_SIZE, node);
+    void* row2 = alloc_buffer(ROW_SIZE, node);
+    if (!row1 || !row2) {
         fprintf(stderr, "Memory allocation failed\n");
         return 1;
     }
@@ -66,80 +93,1106 @@ int main() {
     memset(row1, 0x5A, ROW_SIZE);
     memset(row2, 0xA5, ROW_SIZE);
 
-    // Lock memory to reduce jitter
-    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
-        fprintf(stderr, "Warning: mlockall failed\n");
+    struct adaptive reps = {1000, TEST_ITERATIONS, 1000, ci_target, 2e9};
+    if (ci_target == 0) {
+        reps.min_reps = reps.batch = TEST_ITERATIONS;
+    }
+    printf("Performing up to %d test iterations...\n", TEST_ITERATIONS);
+
+    hist_reset(&first_access);
+    hist_reset(&second_access);
+    hist_reset(&different_row_access);
+    memset(means->counters, 0, sizeof(means->counters));
+    uint64_t before[PMC_MAX], after[PMC_MAX];
+    size_t i = 0;
+    uint64_t begin = rdtsc_start();
+    do {
+        for (size_t batch = 0; batch < reps.batch && i < reps.max_reps; batch++, i++) {
+            // Test 1: Two consecutive accesses to SAME row
+            flush_buffer(row1, ROW_SIZE);  // Ensure not in cache
+
+            // First access to row1
+            pmc_read(&pmcs, before);
+            uint64_t start1 = rdtsc_start();
+            volatile uint64_t* data = (volatile uint64_t*)row1;
+            uint64_t value = *data;  // Read operation
+            asm volatile("" : "+r" (value));  // Prevent optimization
+            uint64_t end1 = rdtsc_end();
+            pmc_read(&pmcs, after);
+            if (pmcs.n) {
+                add_deltas(means->counters[0], before, after);
+                first_cycles[i] = elapsed(start1, end1);
+                for (int c = 0; c < pmcs.n; c++) {
+                    first_deltas[i * pmcs.n + c] = after[c] - before[c];
+                }
+            }
+
+            // Second access to same row1 (without flushing in between)
+            pmc_read(&pmcs, before);
+            uint64_t start2 = rdtsc_start();
+            value = *data;
+            asm volatile("" : "+r" (value));
+            uint64_t end2 = rdtsc_end();
+            pmc_read(&pmcs, after);
+            add_deltas(means->counters[1], before, after);
+
+            hist_record(&first_access, elapsed(start1, end1));
+            hist_record(&second_access, elapsed(start2, end2));
+
+            // Test 2: Access to different row (for comparison)
+            flush_buffer(row2, ROW_SIZE);
+            pmc_read(&pmcs, before);
+            uint64_t start3 = rdtsc_start();
+            volatile uint64_t* data2 = (volatile uint64_t*)row2;
+            value = *data2;
+            asm volatile("" : "+r" (value));
+            uint64_t end3 = rdtsc_end();
+            pmc_read(&pmcs, after);
+            add_deltas(means->counters[2], before, after);
+
+            hist_record(&different_row_access, elapsed(start3, end3));
+        }
+    } while (!adaptive_done(&reps, &first_access, i, rdtsc_end() - begin));
+
+    // Calculate statistics
+    means->first = first_access.sum / (long double)i;
+    means->second = second_access.sum / (long double)i;
+    means->different_row = different_row_access.sum / (long double)i;
+    means->first_median = hist_percentile(&first_access, 50);
+    means->second_median = hist_percentile(&second_access, 50);
+    means->different_row_median = hist_percentile(&different_row_access, 50);
+    means->iterations = i;
+    for (int k = 0; k < 3; k++) {
+        for (int c = 0; c < pmcs.n; c++) {
+            means->counters[k][c] /= (long double)i;
+        }
+    }
+    if (pmcs.n) {
+        // Slow first accesses are those above the 1.5 IQR fence
+        double q1 = (double)hist_percentile(&first_access, 25);
+        double q3 = (double)hist_percentile(&first_access, 75);
+        printf("First access counters:\n");
+        pmc_attribute(&pmcs, first_cycles, first_deltas, i, q3 + 1.5 * (q3 - q1));
+    }
+
+    free_buffer(row1, ROW_SIZE, node);
+    free_buffer(row2, ROW_SIZE, node);
+    return 0;
+}
+
+// First-access latency from the first CPU of every node to rows on every node
+static int run_matrix(void) {
+    int nodes[64], cpus[64];
+    int n_nodes = numa_nodes(nodes, cpus, 64);
+    static long double latency[64][64];
+
+    for (int i = 0; i < n_nodes; i++) {
+        pin_to_cpu(cpus[i]);
+        for (int j = 0; j < n_nodes; j++) {
+            row_means means;
+            if (measure_rows(nodes[j], &means) != 0) {
+                return 1;
+            }
+            latency[i][j] = means.first;
+        }
+    }
+
+    printf("\n=== FIRST ACCESS LATENCY (mean cycles), CPU node (rows) x memory node ===\n");
+    printf("%8s", "");
+    for (int j = 0; j < n_nodes; j++) {
+        printf(" %10d", nodes[j]);
+    }
+    printf("\n");
+    for (int i = 0; i < n_nodes; i++) {
+        printf("%8d", nodes[i]);
+        for (int j = 0; j < n_nodes; j++) {
+            printf(" %10.2Lf", latency[i][j]);
+        }
+        printf("\n");
     }
+    return 0;
+}
+
+// DRAM address mapping (-A) {{{
+// Recovers the physical address to bank mapping from timing alone: two loads
+// to different rows of one bank (a row conflict) are served one after the
+// other, to different banks they overlap. Random lines of a huge page pool
+// are grouped into conflict sets, one per bank. The XOR functions of
+// physical address bits that are constant within every set, and that tell
+// the sets apart, are the bank address functions. A conflict needs channel,
+// rank, bank group and bank to match, so these are all of them at once;
+// timing alone cannot say which function selects the channel. A bit outside
+// the functions that conflicts when flipped alone is a row bit, one that
+// does not is a column bit (function bits may be row bits as well, which
+// this does not separate).
+// Physical addresses come from /proc/self/pagemap, which needs root. Without
+// them the offset into the pool stands in, and that is only right below the
+// page size.
 
-    uint64_t first_access[TEST_ITERATIONS];
-    uint64_t second_access[TEST_ITERATIONS];
-    uint64_t different_row_access[TEST_ITERATIONS];
+#define MAP_SAMPLES 2048      // random pool lines grouped into banks
+#define MAP_ROUNDS 31         // timed accesses per pair, the median is used
+#define MAP_MAX_BANKS 256
+#define MAP_BANK_LINES 64     // lines kept per bank (all in different rows)
+#define MAP_MIN_SET 4         // smaller conflict sets are noise
+#define MAP_MAX_FN_BITS 6     // most bits in one XOR function
+#define MAP_MAX_FNS 16
+#define MAP_TRIALS 2000       // per bank and access kind
+#define MAP_IDLE_NS 10000     // idle time before a row miss access
+
+// Pool size in MiB (-S)
+static size_t pool_mb = 512;
+
+typedef struct {
+    char* virt;
+    uint64_t phys;
+} dram_line;
+
+typedef struct {
+    char* pool;
+    size_t pool_size;
+    uint64_t* frames;         // physical frame of every 4 KiB pool page
+    size_t* by_frame;         // pool pages sorted by frame
+    int physical;             // frames from pagemap, else pool offsets
+    int lo_bit, hi_bit;       // physical address bits examined
+    uint64_t threshold;       // pair cycles above which two lines conflict
+    int n_fns;
+    uint64_t fns[MAP_MAX_FNS];
+    uint64_t row_bits, column_bits;
+    int n_banks;
+    uint64_t bank_id[MAP_MAX_BANKS];
+    int bank_lines[MAP_MAX_BANKS];
+    dram_line lines[MAP_MAX_BANKS][MAP_BANK_LINES];
+} dram_map;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
 
-    printf("Performing %d test iterations...\n", TEST_ITERATIONS);
+static uint64_t phys_of(const dram_map* map, const char* p) {
+    size_t offset = (size_t)(p - map->pool);
+    return map->frames[offset / 4096] * 4096 + offset % 4096;
+}
+
+static const uint64_t* sort_frames;
+
+static int by_frame_compare(const void* a, const void* b) {
+    uint64_t fa = sort_frames[*(const size_t*)a], fb = sort_frames[*(const size_t*)b];
+    return (fa > fb) - (fa < fb);
+}
+
+// Pool address of physical address phys (NULL if it is not in the pool)
+static char* virt_of(const dram_map* map, uint64_t phys) {
+    size_t lo = 0, hi = map->pool_size / 4096;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        uint64_t frame = map->frames[map->by_frame[mid]];
+        if (frame == phys / 4096) {
+            return map->pool + map->by_frame[mid] * 4096 + phys % 4096;
+        }
+        if (frame < phys / 4096) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+// Allocates the pool and reads its frames
+static int map_pool(dram_map* map, int node) {
+    memset(map, 0, sizeof(*map));
+    map->pool_size = pool_mb << 20;
+    map->pool = alloc_buffer(map->pool_size, node);
+    const size_t n_pages = map->pool_size / 4096;
+    map->frames = malloc(sizeof(uint64_t) * n_pages);
+    map->by_frame = malloc(sizeof(size_t) * n_pages);
+    if (!map->pool || !map->frames || !map->by_frame) {
+        fprintf(stderr, "Pool allocation failed\n");
+        return 1;
+    }
+    FILE* f = fopen("/proc/self/pagemap", "rb");
+    if (f && fseek(f, (long)((uintptr_t)map->pool / 4096 * 8), SEEK_SET) == 0 &&
+        fread(map->frames, sizeof(uint64_t), n_pages, f) == n_pages) {
+        map->physical = 1;
+        for (size_t i = 0; i < n_pages; i++) {
+            map->frames[i] &= (1ULL << 55) - 1; // bits 0-54: the frame
+            map->physical &= map->frames[i] != 0;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    if (!map->physical) {
+        fprintf(stderr, "Warning: no physical addresses in /proc/self/pagemap (needs root), "
+                "using pool offsets\n");
+        for (size_t i = 0; i < n_pages; i++) {
+            map->frames[i] = i;
+        }
+    }
+    for (size_t i = 0; i < n_pages; i++) {
+        map->by_frame[i] = i;
+    }
+    sort_frames = map->frames;
+    qsort(map->by_frame, n_pages, sizeof(size_t), by_frame_compare);
 
-    for (int i = 0; i < TEST_ITERATIONS; i++) {
-        // Test 1: Two consecutive accesses to SAME row
-        flush_buffer(row1, ROW_SIZE);  // Ensure not in cache
+    // Bits that vary over the pool, from the line bits up (only those below
+    // the page size without physical addresses)
+    uint64_t ones = 0, zeros = 0;
+    for (size_t i = 0; i < n_pages; i++) {
+        ones |= map->frames[i] * 4096;
+        zeros |= ~(map->frames[i] * 4096);
+    }
+    ones |= 4095;
+    map->lo_bit = 6;
+    map->hi_bit = 63 - __builtin_clzll(ones & zeros);
+    if (!map->physical) {
+        const int page_bits = __builtin_ctzll(page_size_of(page_mode));
+        map->hi_bit = (map->hi_bit < page_bits - 1) ? map->hi_bit : page_bits - 1;
+    }
+    return 0;
+}
 
-        // First access to row1
-        uint64_t start1 = rdtsc_start();
-        volatile uint64_t* data = (volatile uint64_t*)row1;
-        uint64_t value = *data;  // Read operation
-        asm volatile("" : "+r" (value));  // Prevent optimization
-        uint64_t end1 = rdtsc_end();
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
 
-        // Second access to same row1 (without flushing in between)
-        uint64_t start2 = rdtsc_start();
-        value = *data;
+// Median cycles of loading two flushed lines together
+static uint64_t pair_cycles(const char* a, const char* b) {
+    uint64_t t[MAP_ROUNDS];
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+        clflush_line((void*)a);
+        clflush_line((void*)b);
+        asm volatile("mfence" ::: "memory");
+        uint64_t start = rdtsc_start();
+        uint64_t value = *(volatile const uint64_t*)a + *(volatile const uint64_t*)b;
         asm volatile("" : "+r" (value));
-        uint64_t end2 = rdtsc_end();
+        t[r] = elapsed(start, rdtsc_end());
+    }
+    qsort(t, MAP_ROUNDS, sizeof(uint64_t), compare_u64);
+    return t[MAP_ROUNDS / 2];
+}
+
+static int conflicts(const dram_map* map, const char* a, const char* b) {
+    // confirmed once so a single slow median does not merge two banks
+    return pair_cycles(a, b) > map->threshold && pair_cycles(a, b) > map->threshold;
+}
+
+// Splits the latencies of random pairs in two clusters (1-D k-means); the
+// threshold is halfway between them. 0 if there is no conflict cluster.
+static uint64_t conflict_threshold(const dram_line* samples, int n) {
+    enum { PAIRS = 1000 };
+    static uint64_t t[PAIRS];
+    for (int i = 0; i < PAIRS; i++) {
+        t[i] = pair_cycles(samples[next_random() % n].virt, samples[next_random() % n].virt);
+    }
+    qsort(t, PAIRS, sizeof(uint64_t), compare_u64);
+    double threshold = (t[0] + t[PAIRS - 1]) / 2.0;
+    double low = 0, high = 0;
+    int n_high = 0;
+    for (int iter = 0; iter < 32; iter++) {
+        long double sum_low = 0, sum_high = 0;
+        n_high = 0;
+        for (int i = 0; i < PAIRS; i++) {
+            if (t[i] > threshold) {
+                sum_high += t[i];
+                n_high++;
+            }
+            else {
+                sum_low += t[i];
+            }
+        }
+        if (n_high == 0 || n_high == PAIRS) {
+            break;
+        }
+        low = (double)(sum_low / (PAIRS - n_high));
+        high = (double)(sum_high / n_high);
+        threshold = (low + high) / 2;
+    }
+    // Conflicts are one pair in (number of banks): a few per thousand up to
+    // a quarter, clearly slower and with few pairs in between
+    int n_valley = 0;
+    for (int i = 0; i < PAIRS; i++) {
+        n_valley += fabs(t[i] - threshold) < (high - low) / 4;
+    }
+    printf("Pair latency: median %" PRIu64 " cycles, %d of %d pairs around %.0f (others %.0f, "
+           "%d in between)\n", t[PAIRS / 2], n_high, PAIRS, high, low, n_valley);
+    if (n_high < 2 || n_high > PAIRS / 4 || high < low * 1.1 || 2 * n_valley > n_high) {
+        return 0;
+    }
+    return (uint64_t)threshold;
+}
+
+static int parity(uint64_t x) {
+    return __builtin_parityll(x);
+}
+
+// XOR basis of the functions found so far, by leading bit
+static uint64_t fn_basis[64];
+
+// Adds mask to the functions if it is constant within every conflict set
+// (but for the 1 in 20 lines noise may have put into the wrong set), not
+// constant over all of them and independent of the ones found
+static void try_function(dram_map* map, uint64_t mask, const uint64_t* set_phys,
+                         const int* set_start, int n_sets) {
+    const int allowed = set_start[n_sets] / 20;
+    int wrong = 0, first = -1, varies = 0;
+    for (int s = 0; s < n_sets; s++) {
+        int ones = 0, size = set_start[s + 1] - set_start[s];
+        for (int i = set_start[s]; i < set_start[s + 1]; i++) {
+            ones += parity(set_phys[i] & mask);
+        }
+        wrong += (ones < size - ones) ? ones : size - ones;
+        if (wrong > allowed) {
+            return;
+        }
+        int p = 2 * ones > size;
+        if (first < 0) {
+            first = p;
+        }
+        varies |= p != first;
+    }
+    if (!varies || map->n_fns == MAP_MAX_FNS) {
+        return;
+    }
+    uint64_t v = mask;
+    for (int b = 63; b >= 0 && v; b--) {
+        if (!(v >> b & 1)) {
+            continue;
+        }
+        if (!fn_basis[b]) {
+            fn_basis[b] = v;
+            map->fns[map->n_fns++] = mask;
+            return;
+        }
+        v ^= fn_basis[b];
+    }
+}
 
-        first_access[i] = end1 - start1;
-        second_access[i] = end2 - start2;
+// Tries every mask of depth more bits from bits[from..]
+static void search_functions(dram_map* map, const int* bits, int n_bits, int from, int depth,
+                             uint64_t mask, const uint64_t* set_phys, const int* set_start,
+                             int n_sets) {
+    if (depth == 0) {
+        try_function(map, mask, set_phys, set_start, n_sets);
+        return;
+    }
+    for (int i = from; i <= n_bits - depth; i++) {
+        search_functions(map, bits, n_bits, i + 1, depth - 1, mask | (1ULL << bits[i]),
+                         set_phys, set_start, n_sets);
+    }
+}
 
-        // Test 2: Access to different row (for comparison)
-        flush_buffer(row2, ROW_SIZE);
-        uint64_t start3 = rdtsc_start();
-        volatile uint64_t* data2 = (volatile uint64_t*)row2;
-        value = *data2;
+static uint64_t bank_of(const dram_map* map, uint64_t phys) {
+    uint64_t id = 0;
+    for (int f = 0; f < map->n_fns; f++) {
+        id |= (uint64_t)parity(phys & map->fns[f]) << f;
+    }
+    return id;
+}
+
+// Groups random pool lines into conflict sets and recovers the functions
+// and the row and column bits from them. 0 on success.
+static int recover_mapping(dram_map* map) {
+    static dram_line samples[MAP_SAMPLES];
+    static int used[MAP_SAMPLES];
+    static uint64_t set_phys[MAP_SAMPLES];
+    static int set_start[MAP_MAX_BANKS + 1];
+    for (int i = 0; i < MAP_SAMPLES; i++) {
+        samples[i].virt = map->pool + next_random() % (map->pool_size / 64) * 64;
+        samples[i].phys = phys_of(map, samples[i].virt);
+        used[i] = 0;
+    }
+    map->threshold = conflict_threshold(samples, MAP_SAMPLES);
+    if (map->threshold == 0) {
+        fprintf(stderr, "No row conflict signal: pair latencies are not bimodal\n");
+        return 1;
+    }
+    printf("Row conflict threshold: %" PRIu64 " cycles\n", map->threshold);
+
+    // Conflict sets: everything conflicting with a not yet grouped line
+    int n_sets = 0, n_set_lines = 0, n_noise = 0;
+    for (int base = 0; base < MAP_SAMPLES && n_sets < MAP_MAX_BANKS; base++) {
+        if (used[base]) {
+            continue;
+        }
+        used[base] = 1;
+        set_start[n_sets] = n_set_lines;
+        set_phys[n_set_lines++] = samples[base].phys;
+        map->lines[n_sets][0] = samples[base];
+        int count = 1;
+        for (int j = base + 1; j < MAP_SAMPLES; j++) {
+            if (!used[j] && conflicts(map, samples[base].virt, samples[j].virt)) {
+                used[j] = 1;
+                set_phys[n_set_lines++] = samples[j].phys;
+                if (count < MAP_BANK_LINES) {
+                    map->lines[n_sets][count] = samples[j];
+                }
+                count++;
+            }
+        }
+        if (count < MAP_MIN_SET) {
+            n_set_lines = set_start[n_sets]; // noise, drop it
+            n_noise += count;
+            continue;
+        }
+        map->bank_lines[n_sets] = (count < MAP_BANK_LINES) ? count : MAP_BANK_LINES;
+        n_sets++;
+    }
+    set_start[n_sets] = n_set_lines;
+    map->n_banks = n_sets;
+    printf("Conflict sets: %d with %d of %d lines (%d lines in sets below %d)\n", n_sets,
+           n_set_lines, MAP_SAMPLES, n_noise, MAP_MIN_SET);
+    if (n_sets < 2) {
+        fprintf(stderr, "Fewer than two conflict sets, no bank functions to recover\n");
+        return 1;
+    }
+
+    // XOR functions, lightest first so the basis is the simplest one
+    int bits[64], n_bits = 0;
+    for (int b = map->lo_bit; b <= map->hi_bit; b++) {
+        bits[n_bits++] = b;
+    }
+    memset(fn_basis, 0, sizeof(fn_basis));
+    map->n_fns = 0;
+    for (int depth = 1; depth <= MAP_MAX_FN_BITS && depth <= n_bits; depth++) {
+        search_functions(map, bits, n_bits, 0, depth, 0, set_phys, set_start, n_sets);
+    }
+    if ((1 << map->n_fns) != n_sets) {
+        fprintf(stderr, "Warning: %d functions give %d banks but %d conflict sets were found\n",
+                map->n_fns, 1 << map->n_fns, n_sets);
+    }
+    for (int s = 0; s < n_sets; s++) {
+        map->bank_id[s] = bank_of(map, map->lines[s][0].phys);
+    }
+
+    // Row and column bits: flip one bit outside the functions (same bank)
+    uint64_t fn_bits = 0;
+    for (int f = 0; f < map->n_fns; f++) {
+        fn_bits |= map->fns[f];
+    }
+    for (int b = map->lo_bit; b <= map->hi_bit; b++) {
+        if (fn_bits >> b & 1) {
+            continue;
+        }
+        int tests = 0, hits = 0;
+        for (int s = 0; s < n_sets && tests < 16; s++) {
+            char* flipped = virt_of(map, map->lines[s][0].phys ^ (1ULL << b));
+            if (flipped) {
+                tests++;
+                hits += conflicts(map, map->lines[s][0].virt, flipped);
+            }
+        }
+        if (tests > 0) {
+            if (2 * hits > tests) {
+                map->row_bits |= 1ULL << b;
+            }
+            else {
+                map->column_bits |= 1ULL << b;
+            }
+        }
+    }
+    return 0;
+}
+
+static void print_bits(FILE* f, uint64_t mask, const char* separator) {
+    int first = 1;
+    for (int b = 0; b < 64; b++) {
+        if (mask >> b & 1) {
+            fprintf(f, "%s%d", first ? "" : separator, b);
+            first = 0;
+        }
+    }
+}
+
+// Median cycles of MAP_TRIALS timed loads of b, after a load of a when a is
+// not NULL or else after MAP_IDLE_NS of idling (the row buffer presumably
+// precharged by the controller)
+static uint64_t access_after(struct histogram* h, const char* a, const char* b) {
+    const uint64_t idle = (uint64_t)(MAP_IDLE_NS * tsc_hz() / 1e9);
+    hist_reset(h);
+    for (int t = 0; t < MAP_TRIALS; t++) {
+        if (a) {
+            clflush_line((void*)a);
+        }
+        clflush_line((void*)b);
+        asm volatile("mfence" ::: "memory");
+        if (a) {
+            uint64_t value = *(volatile const uint64_t*)a;
+            asm volatile("" : "+r" (value));
+        }
+        else {
+            uint64_t until = rdtsc_start() + idle;
+            while (rdtsc_start() < until) {
+            }
+        }
+        uint64_t start = rdtsc_start();
+        uint64_t value = *(volatile const uint64_t*)b;
         asm volatile("" : "+r" (value));
-        uint64_t end3 = rdtsc_end();
+        hist_record(h, elapsed(start, rdtsc_end()));
+    }
+    return hist_percentile(h, 50);
+}
 
-        different_row_access[i] = end3 - start3;
+// Characterizes the DRAM behind a pool on node: mapping, then row hit, miss
+// and conflict latency per bank. Writes dram_mapping.csv and
+// dram_bank_latency.csv.
+static int run_mapping(int node) {
+    static dram_map map;
+    static struct histogram h;
+    printf("Mapping a %zu MiB pool of %s pages\n", pool_mb, page_mode_names[page_mode]);
+    if (map_pool(&map, node) != 0 || recover_mapping(&map) != 0) {
+        return 1;
     }
 
-    // Calculate statistics
-    long double sum_first = 0, sum_second = 0, sum_diff = 0;
-    for (int i = 0; i < TEST_ITERATIONS; i++) {
-        sum_first += first_access[i];
-        sum_second += second_access[i];
-        sum_diff += different_row_access[i];
+    printf("\n=== ADDRESS MAPPING (%s addresses, bits %d-%d) ===\n",
+           map.physical ? "physical" : "pool offset", map.lo_bit, map.hi_bit);
+    FILE* f = fopen("dram_mapping.csv", "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open dram_mapping.csv\n");
+        return 1;
+    }
+    fprintf(f, "kind,index,bits\n");
+    for (int i = 0; i < map.n_fns; i++) {
+        printf("bank function %d: ", i);
+        print_bits(stdout, map.fns[i], " ^ ");
+        printf("\n");
+        fprintf(f, "function,%d,", i);
+        print_bits(f, map.fns[i], " ");
+        fprintf(f, "\n");
+    }
+    printf("row bits: ");
+    print_bits(stdout, map.row_bits, " ");
+    printf("\ncolumn bits: ");
+    print_bits(stdout, map.column_bits, " ");
+    printf("\n");
+    fprintf(f, "row,,");
+    print_bits(f, map.row_bits, " ");
+    fprintf(f, "\ncolumn,,");
+    print_bits(f, map.column_bits, " ");
+    fprintf(f, "\n");
+    fclose(f);
+    printf("Wrote mapping: dram_mapping.csv\n");
+
+    // A line in the same row: flip the lowest column bit
+    const int column_bit = map.column_bits ? __builtin_ctzll(map.column_bits) : -1;
+    f = fopen("dram_bank_latency.csv", "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open dram_bank_latency.csv\n");
+        return 1;
+    }
+    fprintf(f, "bank,lines,hit_cycles,miss_cycles,conflict_cycles,hit_ns,miss_ns,conflict_ns\n");
+    printf("\n=== ROW BUFFER LATENCY PER BANK (median cycles) ===\n");
+    printf("%6s %6s %8s %8s %8s\n", "bank", "lines", "hit", "miss", "conflict");
+    for (int s = 0; s < map.n_banks; s++) {
+        const char* a = map.lines[s][0].virt;
+        const char* other_row = map.lines[s][1].virt;
+        const char* same_row = (column_bit >= 0) ?
+            virt_of(&map, map.lines[s][0].phys ^ (1ULL << column_bit)) : NULL;
+        uint64_t hit = same_row ? access_after(&h, a, same_row) : 0;
+        uint64_t miss = access_after(&h, NULL, a);
+        uint64_t conflict = access_after(&h, a, other_row);
+        printf("%6" PRIu64 " %6d %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n", map.bank_id[s],
+               map.bank_lines[s], hit, miss, conflict);
+        fprintf(f, "%" PRIu64 ",%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.1f,%.1f,%.1f\n",
+                map.bank_id[s], map.bank_lines[s], hit, miss, conflict, cycles_to_ns(hit),
+                cycles_to_ns(miss), cycles_to_ns(conflict));
+    }
+    fclose(f);
+    printf("Wrote bank latencies: dram_bank_latency.csv\n");
+    printf("Lines differing only in column bits share a row; spread hot data over banks by "
+           "varying the function bits\n");
+    return 0;
+}
+// }}}
+
+// Bank parallelism (-B) {{{
+// k loads in flight at once, to k different banks or to k rows of one
+// bank, either as one batch of independent loads or as k pointer chases
+// through lines of those banks stepping together. The achieved memory-level
+// parallelism is k times the one-load time over the k-load time: near k
+// when the banks overlap, near 1 when they serialize.
+
+#define PAR_MAX_K 16
+
+typedef struct {
+    int k, length;
+    char* lines[PAR_MAX_K][MAP_BANK_LINES];
+} bank_chains;
+
+// k chains of lines, chain i in bank i or, with same_bank, all in bank 0;
+// each line points to the next of its chain. 0 if there are too few banks
+// or lines.
+static int build_chains(const dram_map* map, int k, int same_bank, bank_chains* c) {
+    c->k = k;
+    if (same_bank) {
+        c->length = map->bank_lines[0] / k;
+    }
+    else {
+        if (k > map->n_banks) {
+            return 0;
+        }
+        c->length = MAP_BANK_LINES;
+        for (int i = 0; i < k; i++) {
+            c->length = (map->bank_lines[i] < c->length) ? map->bank_lines[i] : c->length;
+        }
+    }
+    if (c->length < 1) {
+        return 0;
+    }
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < c->length; j++) {
+            c->lines[i][j] = same_bank ? map->lines[0][j * k + i].virt : map->lines[i][j].virt;
+        }
+    }
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < c->length; j++) {
+            *(char**)c->lines[i][j] = c->lines[i][(j + 1) % c->length];
+        }
+    }
+    return 1;
+}
+
+static void flush_chains(const bank_chains* c) {
+    for (int i = 0; i < c->k; i++) {
+        for (int j = 0; j < c->length; j++) {
+            clflush_line(c->lines[i][j]);
+        }
     }
+    asm volatile("mfence" ::: "memory");
+}
 
-    long double mean_first = sum_first / TEST_ITERATIONS;
-    long double mean_second = sum_second / TEST_ITERATIONS;
-    long double mean_diff = sum_diff / TEST_ITERATIONS;
+// Median cycles of one step: all k chains advanced by one line, or one
+// batch of the chains' first lines
+static uint64_t time_step(struct histogram* h, const bank_chains* c, int chase) {
+    hist_reset(h);
+    for (int t = 0; t < MAP_TRIALS; t++) {
+        flush_chains(c);
+        uint64_t start, cycles;
+        if (chase) {
+            char* p[PAR_MAX_K];
+            for (int i = 0; i < c->k; i++) {
+                p[i] = c->lines[i][0];
+            }
+            start = rdtsc_start();
+            for (int step = 0; step < c->length; step++) {
+                for (int i = 0; i < c->k; i++) {
+                    p[i] = *(char* volatile*)p[i];
+                }
+            }
+            cycles = elapsed(start, rdtsc_end()) / c->length;
+            asm volatile("" :: "r" (p[0]));
+        }
+        else {
+            uint64_t sum = 0;
+            start = rdtsc_start();
+            for (int i = 0; i < c->k; i++) {
+                sum += *(volatile const uint64_t*)c->lines[i][0];
+            }
+            cycles = elapsed(start, rdtsc_end());
+            asm volatile("" : "+r" (sum));
+        }
+        hist_record(h, cycles);
+    }
+    return hist_percentile(h, 50);
+}
 
-    printf("\n=== RESULTS ===\n");
-    printf("First access to row:  %.2Lf cycles\n", mean_first);
-    printf("Second access to same row: %.2Lf cycles\n", mean_second);
-    printf("Access to different row:   %.2Lf cycles\n", mean_diff);
-    printf("Speedup ratio (first/second): %.2Lfx\n", mean_first / mean_second);
+// MLP and bandwidth for k = 1, 2, 4, .. max_k. Writes
+// dram_bank_parallelism.csv.
+static int run_parallelism(int node, int max_k) {
+    static dram_map map;
+    static struct histogram h;
+    static bank_chains chains;
+    if (max_k < 1 || max_k > PAR_MAX_K) {
+        fprintf(stderr, "-B needs 1 to %d loads\n", PAR_MAX_K);
+        return 1;
+    }
+    printf("Mapping a %zu MiB pool of %s pages\n", pool_mb, page_mode_names[page_mode]);
+    if (map_pool(&map, node) != 0 || recover_mapping(&map) != 0) {
+        return 1;
+    }
+
+    FILE* f = fopen("dram_bank_parallelism.csv", "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open dram_bank_parallelism.csv\n");
+        return 1;
+    }
+    fprintf(f, "banks,style,k,cycles_per_step,ns_per_step,mlp,gb_per_s\n");
+    printf("\n=== BANK PARALLELISM (median per step of k loads) ===\n");
+    printf("%-9s %-6s %3s %10s %8s %6s %8s\n", "banks", "style", "k", "cycles", "ns", "MLP",
+           "GB/s");
+    for (int same_bank = 0; same_bank <= 1; same_bank++) {
+        for (int chase = 0; chase <= 1; chase++) {
+            uint64_t one = 0;
+            for (int k = 1; k <= max_k; k *= 2) {
+                if (!build_chains(&map, k, same_bank, &chains)) {
+                    fprintf(stderr, "Not enough %s for k=%d\n", same_bank ? "lines in bank 0" : "banks", k);
+                    break;
+                }
+                uint64_t cycles = time_step(&h, &chains, chase);
+                one = (k == 1) ? cycles : one;
+                double ns = cycles_to_ns(cycles);
+                double mlp = cycles ? (double)k * one / cycles : 0;
+                double gbps = ns > 0 ? k * 64.0 / ns : 0;
+                const char* banks = same_bank ? "same" : "distinct";
+                const char* style = chase ? "chase" : "batch";
+                printf("%-9s %-6s %3d %10" PRIu64 " %8.1f %6.2f %8.2f\n", banks, style, k, cycles,
+                       ns, mlp, gbps);
+                fprintf(f, "%s,%s,%d,%" PRIu64 ",%.1f,%.3f,%.3f\n", banks, style, k, cycles, ns,
+                        mlp, gbps);
+            }
+        }
+    }
+    fclose(f);
+    printf("Wrote bank parallelism: dram_bank_parallelism.csv\n");
+    return 0;
+}
+// }}}
+
+// Refresh interference (-F) {{{
+// DRAM loads of one line back to back, timestamped with the cheap
+// rdtsc_fenced() so a sample takes well under a microsecond (cycles here
+// include its few tens of cycles of overhead). Refresh blocks a rank
+// for tRFC (a few hundred ns) every tREFI (7.8 us, 3.9 us above 85 C or
+// with DDR5), so the slow loads it causes line up with that period. The
+// most common gaps between spikes give candidate periods, each refined by
+// folding the spike times: the Rayleigh coherence |mean(exp(2 pi i t / P))|
+// is 1 when every spike has the same phase. Over a span T its peak is only
+// about P^2 / T wide (under a ns for the whole run), so the candidate is
+// narrowed on a short span first and the span grows from there, stepping
+// P^2 / (10 T) each time. Divisors P/2, P/3 .. are coherent as well, so the
+// longest period within 10% of the best coherence is taken.
+
+#define REFRESH_SAMPLES (1 << 20)
+#define REFRESH_MERGE_NS 1000     // slow loads closer than this are one spike
+#define REFRESH_MIN_NS 1000       // periods searched
+#define REFRESH_MAX_NS 20000
+#define REFRESH_BIN_NS 50         // spike gap histogram bins
+#define REFRESH_CANDIDATES 4      // most common gaps refined
+#define REFRESH_MAX_SPIKES 20000  // used for the period search
+
+static double coherence(const double* times, int n, double period) {
+    double c = 0, s = 0;
+    for (int i = 0; i < n; i++) {
+        double phase = 2 * M_PI * times[i] / period;
+        c += cos(phase);
+        s += sin(phase);
+    }
+    return n ? sqrt(c * c + s * s) / n : 0;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// The most coherent period within window of period. The span of spikes
+// folded starts where the peak is about as wide as the window and grows 4x
+// a round, each round stepping a tenth of the peak width around the last
+// best one, up to all n spikes.
+static double refine_period(const double* times, int n, double period, double window,
+                            double* best) {
+    const double total = times[n - 1] - times[0];
+    double span = period * period / window;
+    while (1) {
+        span = (span < total) ? span : total;
+        int m = 0;
+        while (m < n && times[m] - times[0] <= span) {
+            m++;
+        }
+        const double step = period * period / (10 * span);
+        const double center = period;
+        *best = -1;
+        for (double p = center - window; p <= center + window; p += step) {
+            double r = coherence(times, m, p);
+            if (r > *best) {
+                *best = r;
+                period = p;
+            }
+        }
+        if (span >= total) {
+            return period;
+        }
+        window = 2 * step;
+        span *= 4;
+    }
+}
+
+// Refines the most common gaps between the first n spikes into periods
+// (periods[k] with coherence[k]), returns how many
+static int candidate_periods(const double* spikes, int n, double* periods, double* coherences) {
+    const int n_bins = (REFRESH_MAX_NS - REFRESH_MIN_NS) / REFRESH_BIN_NS + 1;
+    int* bins = calloc(n_bins, sizeof(int));
+    double* gaps = malloc(sizeof(double) * (n > 1 ? n - 1 : 1));
+    int n_gaps = 0, n_candidates = 0;
+    if (!bins || !gaps) {
+        free(bins);
+        free(gaps);
+        return 0;
+    }
+    for (int i = 0; i + 1 < n; i++) {
+        double gap = spikes[i + 1] - spikes[i];
+        if (gap >= REFRESH_MIN_NS && gap < REFRESH_MAX_NS + REFRESH_BIN_NS) {
+            gaps[n_gaps++] = gap;
+            bins[(int)((gap - REFRESH_MIN_NS) / REFRESH_BIN_NS)]++;
+        }
+    }
+    qsort(gaps, n_gaps, sizeof(double), compare_double);
+    while (n_candidates < REFRESH_CANDIDATES) {
+        int top = 0;
+        for (int b = 1; b < n_bins; b++) {
+            top = (bins[b] > bins[top]) ? b : top;
+        }
+        if (bins[top] < 3) {
+            break;
+        }
+        // median of the gaps in the bin and its neighbours, which are
+        // then taken
+        const double lo = REFRESH_MIN_NS + (top - 1) * REFRESH_BIN_NS;
+        const double hi = lo + 3 * REFRESH_BIN_NS;
+        int first = 0;
+        while (first < n_gaps && gaps[first] < lo) {
+            first++;
+        }
+        int last = first;
+        while (last < n_gaps && gaps[last] < hi) {
+            last++;
+        }
+        for (int b = top - 1; b <= top + 1; b++) {
+            if (b >= 0 && b < n_bins) {
+                bins[b] = 0;
+            }
+        }
+        periods[n_candidates] = refine_period(spikes, n, gaps[(first + last) / 2], REFRESH_BIN_NS,
+                                              &coherences[n_candidates]);
+        n_candidates++;
+    }
+    free(gaps);
+    free(bins);
+    return n_candidates;
+}
+
+// Writes dram_refresh_spikes.csv
+static int run_refresh(int node) {
+    static struct histogram h;
+    char* line = alloc_buffer(ROW_SIZE, node);
+    uint64_t* starts = malloc(sizeof(uint64_t) * REFRESH_SAMPLES);
+    uint64_t* cycles = malloc(sizeof(uint64_t) * REFRESH_SAMPLES);
+    double* spikes = malloc(sizeof(double) * REFRESH_SAMPLES);
+    if (!line || !starts || !cycles || !spikes) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    memset(line, 0x5A, ROW_SIZE);
+
+    printf("Timing %d DRAM loads back to back...\n", REFRESH_SAMPLES);
+    hist_reset(&h);
+    for (int i = 0; i < REFRESH_SAMPLES; i++) {
+        clflush_line(line);
+        asm volatile("mfence" ::: "memory");
+        uint64_t start = rdtsc_fenced();
+        uint64_t value = *(volatile uint64_t*)line;
+        asm volatile("" : "+r" (value));
+        starts[i] = start;
+        cycles[i] = rdtsc_fenced() - start;
+        hist_record(&h, cycles[i]);
+    }
+    const double span_ns = cycles_to_ns(starts[REFRESH_SAMPLES - 1] - starts[0]);
+
+    // Spikes: far outliers (3 IQR above q3), merged
+    const uint64_t q1 = hist_percentile(&h, 25), q3 = hist_percentile(&h, 75);
+    const uint64_t fence = q3 + 3 * (q3 - q1);
+    FILE* f = fopen("dram_refresh_spikes.csv", "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open dram_refresh_spikes.csv\n");
+        return 1;
+    }
+    fprintf(f, "time_ns,cycles\n");
+    int n_spikes = 0, n_slow = 0;
+    long double slow_sum = 0;
+    for (int i = 0; i < REFRESH_SAMPLES; i++) {
+        if (cycles[i] <= fence) {
+            continue;
+        }
+        double t = cycles_to_ns(starts[i] - starts[0]);
+        fprintf(f, "%.1f,%" PRIu64 "\n", t, cycles[i]);
+        n_slow++;
+        slow_sum += cycles[i];
+        if (n_spikes == 0 || t - spikes[n_spikes - 1] > REFRESH_MERGE_NS) {
+            spikes[n_spikes++] = t;
+        }
+    }
+    fclose(f);
+    printf("%d loads over %.1f ms: median %" PRIu64 " cycles, %d above %" PRIu64
+           " (mean %.0Lf) in %d spikes (%.2f per us)\n", REFRESH_SAMPLES, span_ns / 1e6,
+           hist_percentile(&h, 50), n_slow, fence, n_slow ? slow_sum / n_slow : 0.0L, n_spikes,
+           n_spikes * 1e3 / span_ns);
+    printf("Wrote refresh spikes: dram_refresh_spikes.csv\n");
+
+    const int n = (n_spikes < REFRESH_MAX_SPIKES) ? n_spikes : REFRESH_MAX_SPIKES;
+    double periods[REFRESH_CANDIDATES], coherences[REFRESH_CANDIDATES];
+    const int n_candidates = candidate_periods(spikes, n, periods, coherences);
+    double best = 0, period = 0;
+    for (int k = 0; k < n_candidates; k++) {
+        best = (coherences[k] > best) ? coherences[k] : best;
+    }
+    for (int k = 0; k < n_candidates; k++) {
+        if (coherences[k] >= 0.9 * best && periods[k] > period) {
+            period = periods[k];
+        }
+    }
+
+    printf("\n=== REFRESH ===\n");
+    // Random phases give a coherence around 1/sqrt(n)
+    if (n < 10 || best < 5 / sqrt(n)) {
+        printf("No periodic spikes (best coherence %.3f over %d spikes)\n", best, n);
+    }
+    else {
+        printf("Spike period: %.2f us (coherence %.3f over %d spikes)%s\n", period / 1e3, best, n,
+               (fabs(period - 7800) < 400 || fabs(period - 3900) < 200) ? ", a tREFI" : "");
+    }
+
+    free(spikes);
+    free(cycles);
+    free(starts);
+    free_buffer(line, ROW_SIZE, node);
+    return 0;
+}
+// }}}
+
+int main(int argc, char** argv) {
+    int node = -1, cpu = -1, matrix = 0, use_counters = 0, mapping = 0, parallel = 0, refresh = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:H:MPe:AB:FS:")) != -1) {
+        switch (opt) {
+        case 'n':
+            node = atoi(optarg);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'H':
+            if (!parse_page_mode(optarg)) {
+                fprintf(stderr, "Unknown page size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'M':
+            matrix = 1;
+            break;
+        case 'P':
+            use_counters = 1;
+            break;
+        case 'e':
+            ci_target = atof(optarg) / 100.0;
+            break;
+        case 'A':
+            mapping = 1;
+            break;
+        case 'B':
+            parallel = atoi(optarg);
+            break;
+        case 'F':
+            refresh = 1;
+            break;
+        case 'S':
+            pool_mb = (size_t)atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n node] [-c cpu] [-H 4k|thp|2m|1g] [-M] [-P] [-e ci%%]"
+                    " [-A] [-B k] [-F] [-S MiB]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((mapping || parallel) && page_mode == PAGES_4K) {
+        page_mode = PAGES_THP;
+    }
+    printf("Testing DRAM Row Buffer Policy (Row Size: %d bytes, %s pages)\n", ROW_SIZE,
+           page_mode_names[page_mode]);
+    print_calibration();
+    if (use_counters) {
+        pmc_open(&pmcs);
+    }
+    if (pmcs.n) {
+        first_cycles = malloc(sizeof(uint64_t) * TEST_ITERATIONS);
+        first_deltas = malloc(sizeof(uint64_t) * TEST_ITERATIONS * pmcs.n);
+        if (!first_cycles || !first_deltas) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+    }
+
+    // Lock memory to reduce jitter
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        fprintf(stderr, "Warning: mlockall failed\n");
+    }
+
+    if (matrix) {
+        return run_matrix();
+    }
+    if (cpu >= 0) {
+        pin_to_cpu(cpu);
+    }
+    if (mapping) {
+        return run_mapping(node);
+    }
+    if (parallel) {
+        return run_parallelism(node, parallel);
+    }
+    if (refresh) {
+        return run_refresh(node);
+    }
+
+    row_means means;
+    if (measure_rows(node, &means) != 0) {
+        return 1;
+    }
+    long double mean_first = means.first;
+    long double mean_second = means.second;
+    long double mean_diff = means.different_row;
+
+    printf("\n=== RESULTS (%zu iterations, mean / median) ===\n", means.iterations);
+    printf("First access to row:  %.2Lf cycles / %" PRIu64 " (%.1f ns)\n", mean_first,
+           means.first_median, cycles_to_ns(means.first_median));
+    printf("Second access to same row: %.2Lf cycles / %" PRIu64 " (%.1f ns)\n", mean_second,
+           means.second_median, cycles_to_ns(means.second_median));
+    printf("Access to different row:   %.2Lf cycles / %" PRIu64 " (%.1f ns)\n", mean_diff,
+           means.different_row_median, cycles_to_ns(means.different_row_median));
+    // A cached second access is about as fast as the timer itself and can
+    // come out at 0 cycles once its overhead is taken off: the ratio is then
+    // only a lower bound, against 1 cycle
+    const int below_resolution = mean_second < 1;
+    const double speedup_ratio = (double)(mean_first / (below_resolution ? 1 : mean_second));
+    const char* bound = below_resolution ? "at least " : "";
+    printf("Speedup ratio (first/second): %s%.2fx\n", bound, speedup_ratio);
+    if (pmcs.n) {
+        printf("\n=== COUNTERS (mean per access: first / second / different row) ===\n");
+        for (int c = 0; c < pmcs.n; c++) {
+            printf("%-22s %10.3Lf / %10.3Lf / %10.3Lf\n", pmcs.pmc[c].name, means.counters[0][c],
+                   means.counters[1][c], means.counters[2][c]);
+        }
+    }
 
     // Determine row buffer policy
-    double speedup_ratio = (double)(mean_first / mean_second);
     printf("\n=== CONCLUSION ===\n");
 
     if (speedup_ratio > 1.5) {
         printf("DRAM uses OPEN-ROW policy\n");
-        printf("Second access is %.2fx faster - row buffer was kept open\n", speedup_ratio);
+        printf("Second access is %s%.2fx faster - row buffer was kept open\n", bound,
+               speedup_ratio);
     }
     else {
         printf("DRAM uses CLOSED-ROW policy\n");
         printf("Second access shows minimal speedup (%.2fx)\n", speedup_ratio);
     }
 
-    free(row1);
-    free(row2);
+    pmc_close(&pmcs);
     return 0;
 }
\ No newline at end of file
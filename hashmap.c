@@ -1,148 +1,908 @@
-/* Taken from https://www.tutorialspoint.com/data_structures_algorithms/hash_table_program_in_c.htm*/
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <stdbool.h>
-
-#define SIZE 20
-
-struct DataItem {
-   int data;   
-   int key;
-};
-
-struct DataItem* hashArray[SIZE]; 
-struct DataItem* dummyItem;
-struct DataItem* item;
-
-int hashCode(int key) {
-   return key % SIZE;
-}
-
-struct DataItem *search(int key) {
-   //get the hash 
-   int hashIndex = hashCode(key);  
-    
-   //move in array until an empty 
-   while(hashArray[hashIndex] != NULL) {
-    
-      if(hashArray[hashIndex]->key == key)
-         return hashArray[hashIndex]; 
-            
-      //go to next cell
-      ++hashIndex;
-        
-      //wrap around the table
-      hashIndex %= SIZE;
-   }        
-    
-   return NULL;        
-}
-
-void insert(int key,int data) {
-
-   struct DataItem *item = (struct DataItem*) malloc(sizeof(struct DataItem));
-   item->data = data;  
-   item->key = key;
-
-   //get the hash 
-   int hashIndex = hashCode(key);
-
-   //move in array until an empty or deleted cell
-   while(hashArray[hashIndex] != NULL && hashArray[hashIndex]->key != -1) {
-      //go to next cell
-      ++hashIndex;
-        
-      //wrap around the table
-      hashIndex %= SIZE;
-   }
-    
-   hashArray[hashIndex] = item;
-}
-
-struct DataItem* delete(struct DataItem* item) {
-   int key = item->key;
-
-   //get the hash 
-   int hashIndex = hashCode(key);
-
-   //move in array until an empty
-   while(hashArray[hashIndex] != NULL) {
-    
-      if(hashArray[hashIndex]->key == key) {
-         struct DataItem* temp = hashArray[hashIndex]; 
-            
-         //assign a dummy item at deleted position
-         hashArray[hashIndex] = dummyItem; 
-         return temp;
-      }
-        
-      //go to next cell
-      ++hashIndex;
-        
-      //wrap around the table
-      hashIndex %= SIZE;
-   }      
-    
-   return NULL;        
-}
-
-void display() {
-   int i = 0;
-    
-   for(i = 0; i<SIZE; i++) {
-    
-      if(hashArray[i] != NULL)
-         printf(" (%d,%d)",hashArray[i]->key,hashArray[i]->data);
-      else
-         printf(" ~~ ");
-   }
-    
-   printf("\n");
-}
-
-int main() {
-   dummyItem = (struct DataItem*) malloc(sizeof(struct DataItem));
-   dummyItem->data = -1;  
-   dummyItem->key = -1; 
-
-   insert(1, 20);
-   // Interruption to malloc
-   void *ptr1 = malloc(10 * sizeof(int));
-   insert(2, 70);
-   void *ptr2 = malloc(10 * sizeof(int));
-   insert(2, 70);
-   insert(42, 80);
-   insert(4, 25);
-   void *ptr3 = malloc(10 * sizeof(int));
-   insert(2, 70);
-   insert(12, 44);
-   insert(14, 32);
-   insert(17, 11);
-   void *ptr4 = malloc(10 * sizeof(int));
-   insert(2, 70);
-   insert(13, 78);
-   insert(37, 97);
-   // cleaning up interruption mallocs
-   free(ptr1);
-   free(ptr2);
-   free(ptr3);
-   free(ptr4);
-   display();
-   item = search(37);
-
-   if(item != NULL) {
-      printf("Element found: %d\n", item->data);
-   } else {
-      printf("Element not found\n");
-   }
-
-   delete(item);
-   item = search(37);
-
-   if(item != NULL) {
-      printf("Element found: %d\n", item->data);
-   } else {
-      printf("Element not found\n");
-   }
-}
+/* Taken from https://www.tutorialspoint.com/data_structures_algorithms/hash_table_program_in_c.htm*/
+// Open addressing with the slots stored inline: a key and its data share
+// one 8 byte slot, so a probe reads the slot array itself and a 64 B line
+// holds 8 slots. The capacity is a power of two, hashed by a 32-bit mixer.
+// Past 3/4 full the table doubles; the old slots move over a few per insert,
+// so no single insert pays for the whole copy. Deletes shift the following
+// cluster back, which leaves no tombstones.
+// The original pointer-per-slot table is kept as legacy* for the benchmark,
+// and concurrent* is a variant for many readers and writers.
+//
+// Compile: gcc -O2 -o hashmap hashmap.c -pthread
+// Usage:   hashmap          the original demo
+//          hashmap bench    lookups, inline vs legacy layout, L1 to DRAM sized tables
+//          hashmap batch    lookups/s of search_batch() by batch size, 128 MiB table
+//          hashmap concurrent [threads]
+//                           concurrent* throughput by read ratio and thread count
+//                           (default: up to one thread per CPU)
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#define EMPTY_KEY INT_MIN   // marks a free slot, cannot be inserted
+#define MIN_CAPACITY 16
+#define MIGRATE_STEP 16     // old slots moved per insert while resizing
+#define BATCH_GROUP 64      // keys prefetched ahead by search_batch()
+
+struct Slot {
+   int key;
+   int data;
+};
+
+struct HashMap {
+   struct Slot *slots;
+   size_t capacity;         // power of two
+   size_t count;            // keys in slots and old together
+   // during a resize: the previous slot array, moved from index
+   // oldStart + 1 on (wrapping) and emptied up to oldStart + migrated
+   struct Slot *old;
+   size_t oldCapacity;
+   size_t oldStart;
+   size_t migrated;
+};
+
+// murmur3's 32-bit finalizer
+static inline uint32_t hashCode(int key) {
+   uint32_t h = (uint32_t)key;
+   h ^= h >> 16;
+   h *= 0x85ebca6b;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35;
+   h ^= h >> 16;
+   return h;
+}
+
+static struct Slot *allocSlots(size_t capacity) {
+   struct Slot *slots = NULL;
+   if(posix_memalign((void **)&slots, 64, capacity * sizeof(struct Slot)) != 0) {
+      fprintf(stderr, "out of memory for %zu slots\n", capacity);
+      exit(1);
+   }
+   for(size_t i = 0; i < capacity; i++) {
+      slots[i].key = EMPTY_KEY;
+   }
+   return slots;
+}
+
+struct HashMap *create(size_t expected) {
+   struct HashMap *map = (struct HashMap*) calloc(1, sizeof(struct HashMap));
+   size_t capacity = MIN_CAPACITY;
+   while(capacity * 3 / 4 < expected) {
+      capacity *= 2;
+   }
+   map->capacity = capacity;
+   map->slots = allocSlots(capacity);
+   return map;
+}
+
+void destroy(struct HashMap *map) {
+   free(map->old);
+   free(map->slots);
+   free(map);
+}
+
+// Places a key known to be absent, no resize
+static void place(struct Slot *slots, size_t capacity, int key, int data) {
+   size_t mask = capacity - 1;
+   size_t i = hashCode(key) & mask;
+   while(slots[i].key != EMPTY_KEY) {
+      i = (i + 1) & mask;
+   }
+   slots[i].key = key;
+   slots[i].data = data;
+}
+
+// Index of key in slots (of capacity slots) or -1, probing from i
+static long find(const struct Slot *slots, size_t capacity, size_t i, int key) {
+   size_t mask = capacity - 1;
+   for(size_t probes = 0; probes < capacity; probes++) {
+      if(slots[i].key == key) {
+         return (long)i;
+      }
+      if(slots[i].key == EMPTY_KEY) {
+         return -1;
+      }
+      i = (i + 1) & mask;
+   }
+   return -1;
+}
+
+// Where to probe the old array from: a key whose home was already moved can
+// only be past the moved slots, in the rest of its cluster
+static size_t oldHome(const struct HashMap *map, int key) {
+   size_t mask = map->oldCapacity - 1;
+   size_t home = hashCode(key) & mask;
+   if(((home - map->oldStart - 1) & mask) < map->migrated) {
+      return (map->oldStart + 1 + map->migrated) & mask;
+   }
+   return home;
+}
+
+// Moves up to n old slots over, frees the old array when it is empty
+static void migrate(struct HashMap *map, size_t n) {
+   size_t mask = map->oldCapacity - 1;
+   while(map->old && n-- > 0) {
+      struct Slot *slot = &map->old[(map->oldStart + 1 + map->migrated) & mask];
+      if(slot->key != EMPTY_KEY) {
+         place(map->slots, map->capacity, slot->key, slot->data);
+         slot->key = EMPTY_KEY;
+      }
+      if(++map->migrated == map->oldCapacity) {
+         free(map->old);
+         map->old = NULL;
+      }
+   }
+}
+
+// Moves the old cluster holding slot i over, out of turn. Old clusters
+// only lose keys front to back or whole, so the others still probe as
+// before and migrate() just finds these slots empty later.
+static void migrateCluster(struct HashMap *map, size_t i) {
+   size_t mask = map->oldCapacity - 1;
+   while(map->old[(i - 1) & mask].key != EMPTY_KEY) {
+      i = (i - 1) & mask;
+   }
+   for(; map->old[i].key != EMPTY_KEY; i = (i + 1) & mask) {
+      place(map->slots, map->capacity, map->old[i].key, map->old[i].data);
+      map->old[i].key = EMPTY_KEY;
+   }
+}
+
+// Starts moving to a table twice the size. Moving starts after an empty
+// slot so every cluster is moved front to back (see oldHome()).
+static void grow(struct HashMap *map) {
+   migrate(map, SIZE_MAX); // a previous resize must be done first
+   map->old = map->slots;
+   map->oldCapacity = map->capacity;
+   map->oldStart = 0;
+   while(map->old[map->oldStart].key != EMPTY_KEY) {
+      map->oldStart++;
+   }
+   map->migrated = 0;
+   map->capacity *= 2;
+   map->slots = allocSlots(map->capacity);
+}
+
+// search() with the key's home slot already hashed
+static struct Slot *searchFrom(struct HashMap *map, int key, size_t home) {
+   if(key == EMPTY_KEY) {
+      return NULL; // would match a free slot
+   }
+   long i = find(map->slots, map->capacity, home, key);
+   if(i >= 0) {
+      return &map->slots[i];
+   }
+   if(map->old) {
+      i = find(map->old, map->oldCapacity, oldHome(map, key), key);
+      if(i >= 0) {
+         return &map->old[i];
+      }
+   }
+   return NULL;
+}
+
+struct Slot *search(struct HashMap *map, int key) {
+   return searchFrom(map, key, hashCode(key) & (map->capacity - 1));
+}
+
+// Batched search(): out[i] = search(map, keys[i]). Keys go in groups of
+// BATCH_GROUP: a first pass hashes the group and prefetches every home slot
+// (and the old one while resizing), the second probes them, by then mostly
+// in cache, so the group's misses overlap instead of stalling one by one.
+void search_batch(struct HashMap *map, const int *keys, size_t n, struct Slot **out) {
+   size_t mask = map->capacity - 1;
+   size_t homes[BATCH_GROUP];
+   for(size_t base = 0; base < n; base += BATCH_GROUP) {
+      size_t group = (n - base < BATCH_GROUP) ? n - base : BATCH_GROUP;
+      for(size_t g = 0; g < group; g++) {
+         homes[g] = hashCode(keys[base + g]) & mask;
+         __builtin_prefetch(&map->slots[homes[g]]);
+         if(map->old) {
+            __builtin_prefetch(&map->old[oldHome(map, keys[base + g])]);
+         }
+      }
+      for(size_t g = 0; g < group; g++) {
+         out[base + g] = searchFrom(map, keys[base + g], homes[g]);
+      }
+   }
+}
+
+// Inserts key or updates its data. false for EMPTY_KEY.
+bool insert(struct HashMap *map, int key, int data) {
+   if(key == EMPTY_KEY) {
+      return false;
+   }
+   struct Slot *slot = search(map, key);
+   if(slot != NULL) {
+      slot->data = data;
+      return true;
+   }
+   if((map->count + 1) * 4 > map->capacity * 3) {
+      grow(map);
+   }
+   migrate(map, MIGRATE_STEP);
+   place(map->slots, map->capacity, key, data);
+   map->count++;
+   return true;
+}
+
+// Removes key (false if absent or EMPTY_KEY), shifting the rest of its
+// cluster back
+bool delete(struct HashMap *map, int key) {
+   if(key == EMPTY_KEY) {
+      return false;
+   }
+   size_t home = hashCode(key) & (map->capacity - 1);
+   long found = find(map->slots, map->capacity, home, key);
+   if(found < 0 && map->old) {
+      // shifting in a half moved array would break its clusters, so the
+      // key's cluster comes over first
+      long i = find(map->old, map->oldCapacity, oldHome(map, key), key);
+      if(i >= 0) {
+         migrateCluster(map, (size_t)i);
+         found = find(map->slots, map->capacity, home, key);
+      }
+   }
+   if(found < 0) {
+      return false;
+   }
+   size_t mask = map->capacity - 1;
+   size_t hole = (size_t)found;
+   size_t j = hole;
+   while(true) {
+      j = (j + 1) & mask;
+      if(map->slots[j].key == EMPTY_KEY) {
+         break;
+      }
+      // move j into the hole unless its home lies in (hole, j]
+      size_t jHome = hashCode(map->slots[j].key) & mask;
+      if(((j - jHome) & mask) >= ((j - hole) & mask)) {
+         map->slots[hole] = map->slots[j];
+         hole = j;
+      }
+   }
+   map->slots[hole].key = EMPTY_KEY;
+   map->count--;
+   return true;
+}
+
+void display(struct HashMap *map) {
+   size_t i = 0;
+
+   for(i = 0; i<map->capacity; i++) {
+
+      if(map->slots[i].key != EMPTY_KEY)
+         printf(" (%d,%d)",map->slots[i].key,map->slots[i].data);
+      else
+         printf(" ~~ ");
+   }
+
+   printf("\n");
+}
+
+// The original layout {{{
+// A pointer per slot to a malloc'd item, key % size and linear probing.
+// Only what the benchmark needs, sized up front since it cannot grow.
+struct DataItem {
+   int data;
+   int key;
+};
+
+struct LegacyMap {
+   struct DataItem **hashArray;
+   int size;
+};
+
+struct LegacyMap *legacyCreate(size_t expected) {
+   struct LegacyMap *map = (struct LegacyMap*) malloc(sizeof(struct LegacyMap));
+   map->size = (int)(expected * 4 / 3 + 1);
+   map->hashArray = (struct DataItem**) calloc(map->size, sizeof(struct DataItem*));
+   return map;
+}
+
+void legacyDestroy(struct LegacyMap *map) {
+   for(int i = 0; i < map->size; i++) {
+      free(map->hashArray[i]);
+   }
+   free(map->hashArray);
+   free(map);
+}
+
+int legacyHashCode(struct LegacyMap *map, int key) {
+   return (int)((unsigned)key % (unsigned)map->size);
+}
+
+struct DataItem *legacySearch(struct LegacyMap *map, int key) {
+   //get the hash
+   int hashIndex = legacyHashCode(map, key);
+
+   //move in array until an empty
+   while(map->hashArray[hashIndex] != NULL) {
+
+      if(map->hashArray[hashIndex]->key == key)
+         return map->hashArray[hashIndex];
+
+      //go to next cell
+      ++hashIndex;
+
+      //wrap around the table
+      hashIndex %= map->size;
+   }
+
+   return NULL;
+}
+
+void legacyInsert(struct LegacyMap *map, int key, int data) {
+
+   struct DataItem *item = (struct DataItem*) malloc(sizeof(struct DataItem));
+   item->data = data;
+   item->key = key;
+
+   //get the hash
+   int hashIndex = legacyHashCode(map, key);
+
+   //move in array until an empty or deleted cell
+   while(map->hashArray[hashIndex] != NULL && map->hashArray[hashIndex]->key != -1) {
+      //go to next cell
+      ++hashIndex;
+
+      //wrap around the table
+      hashIndex %= map->size;
+   }
+
+   map->hashArray[hashIndex] = item;
+}
+// }}}
+
+// Concurrent table {{{
+// The same inline layout for many threads, each slot one atomic word with
+// the key in the upper and the data in the lower half:
+//   - concurrentSearch() takes no lock: atomic loads along the probe
+//   - concurrentInsert() claims an empty slot or updates its key's data with
+//     a CAS, concurrentDelete() swaps the word for a tombstone
+//   - writers hold one of WRITER_STRIPES mutexes (by thread), so they only
+//     contend with each other when they share a stripe. A resize takes all
+//     stripes, rehashes the live keys into a new array (twice the size, or
+//     the same to drop the tombstones) and publishes it.
+//   - readers may still be in the old array, so it is freed after an epoch
+//     grace period: every reader announces the epoch it entered in and the
+//     resize waits until none is left in an older one
+// Slots only ever go empty -> key -> tombstone within an array, so a probe
+// that reaches an empty slot has seen every slot its key could be in.
+#define TOMBSTONE_KEY (INT_MIN + 1)  // deleted, by concurrent* only
+#define WRITER_STRIPES 64
+#define MAX_THREADS 256
+
+struct ConcurrentArray {
+   size_t capacity;                  // power of two
+   _Atomic uint64_t slots[];
+};
+
+// Cache line sized so neighbours do not share one
+struct Stripe {
+   pthread_mutex_t lock;
+   char pad[64 - sizeof(pthread_mutex_t) % 64];
+};
+
+struct EpochSlot {
+   _Atomic uint64_t epoch;           // 0: not reading
+   char pad[64 - sizeof(uint64_t)];
+};
+
+struct ConcurrentMap {
+   _Atomic(struct ConcurrentArray *) array;
+   _Atomic size_t used;              // non-empty slots (keys and tombstones)
+   _Atomic size_t count;             // keys
+   _Atomic uint64_t epoch;
+   struct Stripe stripes[WRITER_STRIPES];
+   struct EpochSlot readers[MAX_THREADS];
+};
+
+// Thread indices, given back when a thread exits
+static _Atomic bool threadTaken[MAX_THREADS];
+static _Thread_local int threadIndex = -1;
+static pthread_key_t threadKey;
+static pthread_once_t threadKeyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseThread(void *index) {
+   atomic_store(&threadTaken[(intptr_t)index - 1], false);
+}
+
+static void createThreadKey(void) {
+   pthread_key_create(&threadKey, releaseThread);
+}
+
+// This thread's index into readers[] and stripes[]
+static int currentThread(void) {
+   if(threadIndex < 0) {
+      pthread_once(&threadKeyOnce, createThreadKey);
+      for(int i = 0; i < MAX_THREADS && threadIndex < 0; i++) {
+         bool taken = false;
+         if(atomic_compare_exchange_strong(&threadTaken[i], &taken, true)) {
+            threadIndex = i;
+         }
+      }
+      if(threadIndex < 0) {
+         fprintf(stderr, "more than %d threads\n", MAX_THREADS);
+         exit(1);
+      }
+      pthread_setspecific(threadKey, (void *)(intptr_t)(threadIndex + 1));
+   }
+   return threadIndex;
+}
+
+static inline uint64_t packSlot(int key, int data) {
+   return ((uint64_t)(uint32_t)key << 32) | (uint32_t)data;
+}
+
+static inline int slotKey(uint64_t word) {
+   return (int)(uint32_t)(word >> 32);
+}
+
+static inline int slotData(uint64_t word) {
+   return (int)(uint32_t)word;
+}
+
+static struct ConcurrentArray *allocArray(size_t capacity) {
+   struct ConcurrentArray *array = NULL;
+   if(posix_memalign((void **)&array, 64, sizeof(*array) + capacity * sizeof(uint64_t)) != 0) {
+      fprintf(stderr, "out of memory for %zu slots\n", capacity);
+      exit(1);
+   }
+   array->capacity = capacity;
+   for(size_t i = 0; i < capacity; i++) {
+      atomic_init(&array->slots[i], packSlot(EMPTY_KEY, 0));
+   }
+   return array;
+}
+
+struct ConcurrentMap *concurrentCreate(size_t expected) {
+   struct ConcurrentMap *map = NULL;
+   if(posix_memalign((void **)&map, 64, sizeof(*map)) != 0) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+   }
+   memset(map, 0, sizeof(*map));
+   size_t capacity = MIN_CAPACITY;
+   while(capacity * 3 / 4 < expected) {
+      capacity *= 2;
+   }
+   atomic_init(&map->array, allocArray(capacity));
+   atomic_init(&map->epoch, 1);
+   for(int i = 0; i < WRITER_STRIPES; i++) {
+      pthread_mutex_init(&map->stripes[i].lock, NULL);
+   }
+   return map;
+}
+
+void concurrentDestroy(struct ConcurrentMap *map) {
+   for(int i = 0; i < WRITER_STRIPES; i++) {
+      pthread_mutex_destroy(&map->stripes[i].lock);
+   }
+   free(atomic_load(&map->array));
+   free(map);
+}
+
+static inline void epochEnter(struct ConcurrentMap *map) {
+   // seq_cst: the announcement must be visible before the array is loaded
+   atomic_store(&map->readers[currentThread()].epoch, atomic_load(&map->epoch));
+}
+
+static inline void epochExit(struct ConcurrentMap *map) {
+   atomic_store_explicit(&map->readers[currentThread()].epoch, 0, memory_order_release);
+}
+
+// Frees array once no reader can still be in it
+static void retire(struct ConcurrentMap *map, struct ConcurrentArray *array) {
+   uint64_t epoch = atomic_fetch_add(&map->epoch, 1) + 1;
+   // all of them: a thread taking an index now may still get the old array
+   for(int i = 0; i < MAX_THREADS; i++) {
+      uint64_t e;
+      while((e = atomic_load(&map->readers[i].epoch)) != 0 && e < epoch) {
+         sched_yield();
+      }
+   }
+   free(array);
+}
+
+// Finds key's data, false if absent or one of the two reserved keys
+bool concurrentSearch(struct ConcurrentMap *map, int key, int *data) {
+   if(key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+      return false;
+   }
+   epochEnter(map);
+   // seq_cst after the announcement, see retire()
+   struct ConcurrentArray *array = atomic_load(&map->array);
+   size_t mask = array->capacity - 1;
+   size_t i = hashCode(key) & mask;
+   bool found = false;
+   for(size_t probes = 0; probes < array->capacity; probes++) {
+      uint64_t word = atomic_load_explicit(&array->slots[i], memory_order_acquire);
+      if(slotKey(word) == key) {
+         *data = slotData(word);
+         found = true;
+         break;
+      }
+      if(slotKey(word) == EMPTY_KEY) {
+         break;
+      }
+      i = (i + 1) & mask;
+   }
+   epochExit(map);
+   return found;
+}
+
+// Rehashes into a new array if the current one is still past 3/4 used,
+// with every writer stripe held
+static void concurrentResize(struct ConcurrentMap *map) {
+   for(int i = 0; i < WRITER_STRIPES; i++) {
+      pthread_mutex_lock(&map->stripes[i].lock);
+   }
+   struct ConcurrentArray *old = atomic_load(&map->array);
+   if(atomic_load(&map->used) * 4 > old->capacity * 3) {
+      // double when the keys alone fill half of it, else just drop tombstones
+      size_t count = atomic_load(&map->count);
+      size_t capacity = (count * 2 > old->capacity) ? old->capacity * 2 : old->capacity;
+      struct ConcurrentArray *array = allocArray(capacity);
+      size_t mask = capacity - 1;
+      for(size_t i = 0; i < old->capacity; i++) {
+         uint64_t word = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+         int key = slotKey(word);
+         if(key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+            continue;
+         }
+         size_t j = hashCode(key) & mask;
+         while(slotKey(atomic_load_explicit(&array->slots[j], memory_order_relaxed)) != EMPTY_KEY) {
+            j = (j + 1) & mask;
+         }
+         atomic_store_explicit(&array->slots[j], word, memory_order_relaxed);
+      }
+      atomic_store(&map->used, count);
+      atomic_store(&map->array, array);
+      retire(map, old);
+   }
+   for(int i = WRITER_STRIPES - 1; i >= 0; i--) {
+      pthread_mutex_unlock(&map->stripes[i].lock);
+   }
+}
+
+// Inserts key or updates its data. false for the two reserved keys.
+bool concurrentInsert(struct ConcurrentMap *map, int key, int data) {
+   if(key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+      return false;
+   }
+   const uint64_t word = packSlot(key, data);
+   pthread_mutex_t *lock = &map->stripes[currentThread() % WRITER_STRIPES].lock;
+   while(true) {
+      pthread_mutex_lock(lock);
+      struct ConcurrentArray *array = atomic_load_explicit(&map->array, memory_order_acquire);
+      size_t mask = array->capacity - 1;
+      size_t i = hashCode(key) & mask;
+      bool done = false, claimed = false;
+      for(size_t probes = 0; probes < array->capacity && !done; ) {
+         uint64_t seen = atomic_load_explicit(&array->slots[i], memory_order_acquire);
+         if(slotKey(seen) == key) {
+            // update, unless it was deleted meanwhile (then look further)
+            done = atomic_compare_exchange_weak(&array->slots[i], &seen, word);
+         } else if(slotKey(seen) == EMPTY_KEY) {
+            // claim, or see who beat us to it
+            done = claimed = atomic_compare_exchange_weak(&array->slots[i], &seen, word);
+         } else {
+            i = (i + 1) & mask;
+            probes++;
+         }
+      }
+      size_t used = 0;
+      if(claimed) {
+         used = atomic_fetch_add(&map->used, 1) + 1;
+         atomic_fetch_add(&map->count, 1);
+      }
+      size_t capacity = array->capacity;
+      pthread_mutex_unlock(lock);
+      if(done && used * 4 <= capacity * 3) {
+         return true;
+      }
+      concurrentResize(map); // full, or past 3/4 after this insert
+      if(done) {
+         return true;
+      }
+   }
+}
+
+// Removes key, false if absent or one of the two reserved keys
+bool concurrentDelete(struct ConcurrentMap *map, int key) {
+   if(key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+      return false; // would turn a free slot into a tombstone
+   }
+   const uint64_t tombstone = packSlot(TOMBSTONE_KEY, 0);
+   pthread_mutex_t *lock = &map->stripes[currentThread() % WRITER_STRIPES].lock;
+   pthread_mutex_lock(lock);
+   struct ConcurrentArray *array = atomic_load_explicit(&map->array, memory_order_acquire);
+   size_t mask = array->capacity - 1;
+   size_t i = hashCode(key) & mask;
+   bool deleted = false;
+   for(size_t probes = 0; probes < array->capacity; ) {
+      uint64_t seen = atomic_load_explicit(&array->slots[i], memory_order_acquire);
+      if(slotKey(seen) == key) {
+         if(atomic_compare_exchange_weak(&array->slots[i], &seen, tombstone)) {
+            deleted = true;
+            break;
+         }
+         continue; // its data changed or another delete won, look again
+      }
+      if(slotKey(seen) == EMPTY_KEY) {
+         break;
+      }
+      i = (i + 1) & mask;
+      probes++;
+   }
+   if(deleted) {
+      atomic_fetch_sub(&map->count, 1);
+   }
+   pthread_mutex_unlock(lock);
+   return deleted;
+}
+// }}}
+
+// Benchmark {{{
+#define BENCH_LOOKUPS (1 << 22)
+#define BENCH_MIN_KEYS (1 << 10)   // 16 KiB of inline slots
+#define BENCH_MAX_KEYS (1 << 23)   // 128 MiB
+
+static double nowNs(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rngState = 88172645463325252ULL;
+
+static uint64_t nextRandom(void) {
+   rngState ^= rngState << 13;
+   rngState ^= rngState >> 7;
+   rngState ^= rngState << 17;
+   return rngState;
+}
+
+// Distinct random looking non-negative keys for 0 .. n-1: odd multiplies
+// and a xorshift are bijections mod 2^31
+static int benchKey(size_t i) {
+   uint32_t x = (uint32_t)i;
+   x = (x * 0x2545f491u) & INT_MAX;
+   x ^= x >> 15;
+   x = (x * 0x6b43a9b5u) & INT_MAX;
+   x ^= x >> 13;
+   return (int)x;
+}
+
+static int *lookupKeys(size_t n) {
+   int *keys = (int*) malloc(BENCH_LOOKUPS * sizeof(int));
+   for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+      keys[i] = benchKey(nextRandom() % n);
+   }
+   return keys;
+}
+
+int bench(void) {
+   printf("%10s %12s %14s %14s %10s\n", "keys", "inline_KiB", "inline_ns", "legacy_ns", "speedup");
+   for(size_t n = BENCH_MIN_KEYS; n <= BENCH_MAX_KEYS; n *= 2) {
+      struct HashMap *map = create(0); // grows as it fills
+      struct LegacyMap *legacy = legacyCreate(n);
+      for(size_t i = 0; i < n; i++) {
+         insert(map, benchKey(i), (int)i);
+         legacyInsert(legacy, benchKey(i), (int)i);
+      }
+      int *keys = lookupKeys(n);
+      long sum = 0;
+
+      double t0 = nowNs();
+      for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+         sum += search(map, keys[i])->data;
+      }
+      double t1 = nowNs();
+      for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+         sum -= legacySearch(legacy, keys[i])->data;
+      }
+      double t2 = nowNs();
+
+      if(sum != 0) {
+         fprintf(stderr, "layouts disagree\n");
+         return 1;
+      }
+      double inlineNs = (t1 - t0) / BENCH_LOOKUPS, legacyNs = (t2 - t1) / BENCH_LOOKUPS;
+      printf("%10zu %12zu %14.2f %14.2f %9.2fx\n", n, map->capacity * sizeof(struct Slot) / 1024,
+             inlineNs, legacyNs, legacyNs / inlineNs);
+      free(keys);
+      legacyDestroy(legacy);
+      destroy(map);
+   }
+   return 0;
+}
+
+// search_batch() against search() on a table far bigger than the LLC
+int benchBatch(void) {
+   const size_t n = BENCH_MAX_KEYS;
+   struct HashMap *map = create(n);
+   for(size_t i = 0; i < n; i++) {
+      insert(map, benchKey(i), (int)i);
+   }
+   int *keys = lookupKeys(n);
+   struct Slot **out = (struct Slot**) malloc(BENCH_LOOKUPS * sizeof(struct Slot*));
+   long expected = 0;
+
+   double t0 = nowNs();
+   for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+      expected += search(map, keys[i])->data;
+   }
+   double scalar = BENCH_LOOKUPS / (nowNs() - t0) * 1e3;
+   printf("%zu keys, %zu KiB of slots\n", n, map->capacity * sizeof(struct Slot) / 1024);
+   printf("%10s %14s %10s\n", "batch", "Mlookups/s", "speedup");
+   printf("%10s %14.2f %9.2fx\n", "search", scalar, 1.0);
+   for(size_t batch = 1; batch <= 4 * BATCH_GROUP; batch *= 2) {
+      t0 = nowNs();
+      for(size_t i = 0; i < BENCH_LOOKUPS; i += batch) {
+         size_t m = (BENCH_LOOKUPS - i < batch) ? BENCH_LOOKUPS - i : batch;
+         search_batch(map, &keys[i], m, &out[i]);
+      }
+      double rate = BENCH_LOOKUPS / (nowNs() - t0) * 1e3;
+      long sum = 0;
+      for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+         sum += out[i]->data;
+      }
+      if(sum != expected) {
+         fprintf(stderr, "search_batch disagrees with search\n");
+         return 1;
+      }
+      printf("%10zu %14.2f %9.2fx\n", batch, rate, rate / scalar);
+   }
+   free(out);
+   free(keys);
+   destroy(map);
+   return 0;
+}
+
+// Concurrent throughput
+#define CONCURRENT_KEYS (1 << 20)   // keys drawn from, half of them present
+#define CONCURRENT_MS 300           // per read ratio and thread count
+
+struct Worker {
+   pthread_t thread;
+   struct ConcurrentMap *map;
+   int readPercent;
+   uint64_t seed;
+   _Atomic bool *stop;
+   pthread_barrier_t *start;
+   uint64_t ops;
+   long sum;                         // of the data found, so searches stay
+};
+
+// readPercent% searches, the rest inserts and deletes half and half so the
+// table stays around half of CONCURRENT_KEYS
+static void *concurrentWorker(void *arg) {
+   struct Worker *w = (struct Worker*) arg;
+   uint64_t x = w->seed, ops = 0;
+   long sum = 0;
+   pthread_barrier_wait(w->start);
+   while(!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+      for(int i = 0; i < 256; i++) {
+         x ^= x << 13;
+         x ^= x >> 7;
+         x ^= x << 17;
+         int key = benchKey(x % CONCURRENT_KEYS);
+         int op = (int)((x >> 40) % 200);
+         int data;
+         if(op < 2 * w->readPercent) {
+            sum += concurrentSearch(w->map, key, &data) ? data : 0;
+         } else if(op & 1) {
+            concurrentInsert(w->map, key, (int)ops);
+         } else {
+            concurrentDelete(w->map, key);
+         }
+         ops++;
+      }
+   }
+   w->ops = ops;
+   w->sum = sum;
+   return NULL;
+}
+
+int benchConcurrent(int maxThreads) {
+   static const int readPercents[] = {100, 95, 80, 50, 0};
+   struct Worker *workers = (struct Worker*) calloc(maxThreads, sizeof(struct Worker));
+   printf("%8s %8s %14s\n", "reads%", "threads", "Mops/s");
+   for(size_t r = 0; r < sizeof(readPercents) / sizeof(readPercents[0]); r++) {
+      // 1, 2, 4, .. and maxThreads
+      for(int threads = 1; threads <= maxThreads;
+          threads = (threads < maxThreads && threads * 2 > maxThreads) ? maxThreads : threads * 2) {
+         struct ConcurrentMap *map = concurrentCreate(CONCURRENT_KEYS / 2);
+         for(size_t i = 0; i < CONCURRENT_KEYS; i += 2) {
+            concurrentInsert(map, benchKey(i), (int)i);
+         }
+         _Atomic bool stop = false;
+         pthread_barrier_t start;
+         pthread_barrier_init(&start, NULL, threads + 1);
+         for(int t = 0; t < threads; t++) {
+            workers[t].map = map;
+            workers[t].readPercent = readPercents[r];
+            workers[t].seed = 0x9E3779B97F4A7C15ULL * (t + 1);
+            workers[t].stop = &stop;
+            workers[t].start = &start;
+            pthread_create(&workers[t].thread, NULL, concurrentWorker, &workers[t]);
+         }
+         pthread_barrier_wait(&start);
+         double t0 = nowNs();
+         struct timespec pause = {0, CONCURRENT_MS * 1000000L};
+         nanosleep(&pause, NULL);
+         atomic_store(&stop, true);
+         uint64_t ops = 0;
+         for(int t = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+            ops += workers[t].ops;
+         }
+         double elapsed = nowNs() - t0;
+         printf("%8d %8d %14.2f\n", readPercents[r], threads, ops / elapsed * 1e3);
+         pthread_barrier_destroy(&start);
+         concurrentDestroy(map);
+      }
+   }
+   free(workers);
+   return 0;
+}
+// }}}
+
+int main(int argc, char **argv) {
+   if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+      return bench();
+   }
+   if(argc > 1 && strcmp(argv[1], "batch") == 0) {
+      return benchBatch();
+   }
+   if(argc > 1 && strcmp(argv[1], "concurrent") == 0) {
+      int threads = (argc > 2) ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if(threads < 1 || threads >= MAX_THREADS) {
+         fprintf(stderr, "threads must be 1 to %d\n", MAX_THREADS - 1);
+         return 1;
+      }
+      return benchConcurrent(threads);
+   }
+   struct HashMap *map = create(0);
+
+   insert(map, 1, 20);
+   insert(map, 2, 70);
+   insert(map, 2, 70);
+   insert(map, 42, 80);
+   insert(map, 4, 25);
+   insert(map, 2, 70);
+   insert(map, 12, 44);
+   insert(map, 14, 32);
+   insert(map, 17, 11);
+   insert(map, 2, 70);
+   insert(map, 13, 78);
+   insert(map, 37, 97);
+   display(map);
+   struct Slot *item = search(map, 37);
+
+   if(item != NULL) {
+      printf("Element found: %d\n", item->data);
+   } else {
+      printf("Element not found\n");
+   }
+
+   delete(map, 37);
+   item = search(map, 37);
+
+   if(item != NULL) {
+      printf("Element found: %d\n", item->data);
+   } else {
+      printf("Element not found\n");
+   }
+   destroy(map);
+}
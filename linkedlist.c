@@ -1,104 +1,405 @@
-/*
-Heavily taken from 
-http://www.thelearningpoint.net/computer-science/data-structures-singly-linked-list-with-c-program-source-code
-*/
-#include <stdio.h>
-#include <stdlib.h>
-
-typedef struct Node {
-        int data;
-        struct Node *next;
-} node;
-
-void insert(node *pointer, int data) {
-        while(pointer->next!=NULL) {
-            pointer = pointer -> next;
-        }
-        pointer->next = (node *)malloc(sizeof(node));
-        pointer = pointer->next;
-        pointer->data = data;
-        pointer->next = NULL;
-}
-
-int find(node *pointer, int key) {
-        pointer = pointer -> next;
-        while(pointer!=NULL) {
-                if(pointer->data == key) {
-                    return 1;
-                }
-                pointer = pointer -> next;
-        }
-        return 0;
-}
-
-void delete(node *pointer, int data) {
-        while (pointer->next!=NULL && (pointer->next)->data != data) {
-                pointer = pointer -> next;
-        }
-        if (pointer->next==NULL) {
-                printf("Element %d is not present in the list\n",data);
-                return;
-        }
-        node *temp;
-        temp = pointer -> next;
-        pointer->next = temp->next;
-        free(temp);
-        return;
-}
-
-void print(node *pointer) {
-        if(pointer==NULL) {
-            return;
-        }
-        printf("%d ",pointer->data);
-        print(pointer->next);
-}
-
-int main() {
-        /* initialization */
-        node *start,*temp;
-        start = (node *)malloc(sizeof(node)); 
-        temp = start;
-        temp -> next = NULL;
-
-        /* test harness */
-        insert(start, 2);
-        delete(start, 2);
-        int status = find(start, 2);
-        if(status) {
-            printf("Element Found\n");
-        } else {
-            printf("Element Not Found\n");
-        }
-        insert(start, 5);
-	insert(start, 10);
-	// interrupt malloc
-	void *ptr1 = malloc(5 * sizeof(int));
-	insert(start, 22);
-	void *ptr2 = malloc(5 * sizeof(int));
-	insert(start, 7);
-	insert(start, 9);
-	insert(start, 2);
-	void *ptr3 = malloc(5 * sizeof(int));
-	insert(start, 11);
-	insert(start, 11);
-	insert(start, 77);
-	void *ptr4 = malloc(5 * sizeof(int));
-	insert(start, 62);
-	insert(start, 29);
-	// cleaning up
-	free(ptr1);
-	free(ptr2);
-	free(ptr3);
-	free(ptr4);
-        status = find(start, 5);
-        if(status) {
-            printf("Element Found\n");
-        } else {
-            printf("Element Not Found\n");
-        }
-        printf("The list is ");
-        print(start->next);
-        printf("\n");
-        delete(start, 5);
-}
+/*
+Heavily taken from
+http://www.thelearningpoint.net/computer-science/data-structures-singly-linked-list-with-c-program-source-code
+*/
+// A list keeps a tail pointer, so insert() appends in O(1), and takes its
+// nodes from malloc (scattered over the heap as the program allocates) or
+// from an arena of contiguous slabs, so nodes appended one after another sit
+// next to each other in memory. The unrolled list packs UNROLL values into
+// each cache line sized node; findUnrolled() and deleteUnrolled() compare a
+// whole node at once with SSE2.
+//
+// Compile: gcc -O2 -o linkedlist linkedlist.c
+// Usage:   linkedlist         the original demo
+//          linkedlist bench   traversal of scattered, arena and unrolled lists,
+//                             L1 to DRAM sized
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <emmintrin.h>
+
+typedef struct Node {
+        int data;
+        struct Node *next;
+} node;
+
+// Arena {{{
+// Fixed size objects carved in order out of SLAB_BYTES slabs, freed ones
+// reused first. Everything goes back at once with arenaDestroy().
+#define SLAB_BYTES (64 * 1024)
+
+typedef struct Slab {
+        struct Slab *next;
+        char pad[64 - sizeof(struct Slab *)]; // objects start 64 B aligned
+        char objects[];
+} slab;
+
+typedef struct Arena {
+        size_t size;            // object size, a multiple of 8
+        slab *slabs;            // the current one first
+        size_t used;            // bytes handed out of the current slab
+        void *freeList;         // freed objects, linked through their first word
+} arena;
+
+void arenaInit(arena *a, size_t size) {
+        a->size = (size + 7) & ~(size_t)7;
+        a->slabs = NULL;
+        a->used = SLAB_BYTES;
+        a->freeList = NULL;
+}
+
+void *arenaAlloc(arena *a) {
+        if(a->freeList != NULL) {
+                void *p = a->freeList;
+                a->freeList = *(void **)p;
+                return p;
+        }
+        if(a->used + a->size > SLAB_BYTES - sizeof(slab)) {
+                slab *s = NULL;
+                if(posix_memalign((void **)&s, 64, SLAB_BYTES) != 0) {
+                        fprintf(stderr, "Out of memory\n");
+                        exit(1);
+                }
+                s->next = a->slabs;
+                a->slabs = s;
+                a->used = 0;
+        }
+        void *p = a->slabs->objects + a->used;
+        a->used += a->size;
+        return p;
+}
+
+void arenaFree(arena *a, void *p) {
+        *(void **)p = a->freeList;
+        a->freeList = p;
+}
+
+void arenaDestroy(arena *a) {
+        while(a->slabs != NULL) {
+                slab *next = a->slabs->next;
+                free(a->slabs);
+                a->slabs = next;
+        }
+        arenaInit(a, a->size);
+}
+// }}}
+
+typedef struct List {
+        node head;              // sentinel, head.next is the first node
+        node *tail;             // last node (&head when empty)
+        arena *nodes;           // NULL: malloc
+} list;
+
+void init(list *l, arena *nodes) {
+        l->head.next = NULL;
+        l->tail = &l->head;
+        l->nodes = nodes;
+}
+
+static node *newNode(list *l) {
+        return l->nodes ? (node *)arenaAlloc(l->nodes) : (node *)malloc(sizeof(node));
+}
+
+static void freeNode(list *l, node *n) {
+        if(l->nodes) {
+                arenaFree(l->nodes, n);
+        } else {
+                free(n);
+        }
+}
+
+void insert(list *l, int data) {
+        node *pointer = newNode(l);
+        pointer->data = data;
+        pointer->next = NULL;
+        l->tail->next = pointer;
+        l->tail = pointer;
+}
+
+int find(list *l, int key) {
+        node *pointer = l->head.next;
+        while(pointer!=NULL) {
+                if(pointer->data == key) {
+                    return 1;
+                }
+                pointer = pointer -> next;
+        }
+        return 0;
+}
+
+void delete(list *l, int data) {
+        node *pointer = &l->head;
+        while (pointer->next!=NULL && (pointer->next)->data != data) {
+                pointer = pointer -> next;
+        }
+        if (pointer->next==NULL) {
+                printf("Element %d is not present in the list\n",data);
+                return;
+        }
+        node *temp;
+        temp = pointer -> next;
+        pointer->next = temp->next;
+        if(l->tail == temp) {
+                l->tail = pointer;
+        }
+        freeNode(l, temp);
+        return;
+}
+
+void print(list *l) {
+        for(node *pointer = l->head.next; pointer!=NULL; pointer = pointer->next) {
+                printf("%d ",pointer->data);
+        }
+}
+
+// Frees the nodes of a malloc list (an arena list goes with its arena)
+void clear(list *l) {
+        node *pointer = l->head.next;
+        while(pointer!=NULL && l->nodes==NULL) {
+                node *next = pointer->next;
+                free(pointer);
+                pointer = next;
+        }
+        init(l, l->nodes);
+}
+
+// Unrolled list {{{
+// One 64 B node holds up to UNROLL values. Appends fill the tail node;
+// deletes close the gap inside their node and unlink it once empty.
+#define UNROLL 12
+
+typedef struct UNode {
+        int values[UNROLL];
+        int count;
+        struct UNode *next;
+} __attribute__((aligned(64))) unode;
+
+typedef struct UList {
+        unode *first;
+        unode *tail;
+        arena nodes;
+} ulist;
+
+void initUnrolled(ulist *l) {
+        l->first = l->tail = NULL;
+        arenaInit(&l->nodes, sizeof(unode));
+}
+
+void insertUnrolled(ulist *l, int data) {
+        if(l->tail == NULL || l->tail->count == UNROLL) {
+                unode *n = (unode *)arenaAlloc(&l->nodes);
+                n->count = 0;
+                n->next = NULL;
+                if(l->tail) {
+                        l->tail->next = n;
+                } else {
+                        l->first = n;
+                }
+                l->tail = n;
+        }
+        l->tail->values[l->tail->count++] = data;
+}
+
+// Index of key among the count values of n, or -1
+static int findInNode(const unode *n, int key) {
+        const __m128i k = _mm_set1_epi32(key);
+        unsigned mask = 0;
+        for(int i = 0; i < UNROLL; i += 4) {
+                __m128i v = _mm_load_si128((const __m128i *)&n->values[i]);
+                mask |= (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, k))) << i;
+        }
+        mask &= (1u << n->count) - 1;
+        return mask ? __builtin_ctz(mask) : -1;
+}
+
+int findUnrolled(ulist *l, int key) {
+        for(unode *n = l->first; n != NULL; n = n->next) {
+                if(findInNode(n, key) >= 0) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+void deleteUnrolled(ulist *l, int data) {
+        unode *prev = NULL;
+        for(unode *n = l->first; n != NULL; prev = n, n = n->next) {
+                int i = findInNode(n, data);
+                if(i < 0) {
+                        continue;
+                }
+                memmove(&n->values[i], &n->values[i + 1], (n->count - i - 1) * sizeof(int));
+                if(--n->count == 0) {
+                        if(prev) {
+                                prev->next = n->next;
+                        } else {
+                                l->first = n->next;
+                        }
+                        if(l->tail == n) {
+                                l->tail = prev;
+                        }
+                        arenaFree(&l->nodes, n);
+                }
+                return;
+        }
+        printf("Element %d is not present in the list\n",data);
+}
+
+void printUnrolled(ulist *l) {
+        for(unode *n = l->first; n != NULL; n = n->next) {
+                for(int i = 0; i < n->count; i++) {
+                        printf("%d ",n->values[i]);
+                }
+        }
+}
+// }}}
+
+// Benchmark {{{
+// A full scan (find() of a missing key) per list, in ns per element. The
+// scattered list is linked in random order out of separately malloc'd
+// nodes, as a long running heap ends up; the arena list is appended in
+// order; the unrolled list is a twelfth of the nodes.
+#define BENCH_MIN (1 << 9)            // 8 KiB of nodes
+#define BENCH_MAX (1 << 23)           // 128 MiB
+#define BENCH_ELEMENTS (1 << 24)      // scanned per list and size
+
+static double nowNs(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t rngState = 88172645463325252ULL;
+
+static uint64_t nextRandom(void) {
+        rngState ^= rngState << 13;
+        rngState ^= rngState >> 7;
+        rngState ^= rngState << 17;
+        return rngState;
+}
+
+int bench(void) {
+        printf("%10s %12s %14s %14s %14s\n", "elements", "nodes_KiB", "scattered_ns", "arena_ns", "unrolled_ns");
+        for(size_t n = BENCH_MIN; n <= BENCH_MAX; n *= 2) {
+                // scattered: malloc'd nodes linked in a random order
+                node **nodes = (node **)malloc(n * sizeof(node *));
+                for(size_t i = 0; i < n; i++) {
+                        nodes[i] = (node *)malloc(sizeof(node));
+                        nodes[i]->data = (int)i;
+                }
+                for(size_t i = n - 1; i > 0; i--) {
+                        size_t j = nextRandom() % (i + 1);
+                        node *t = nodes[i];
+                        nodes[i] = nodes[j];
+                        nodes[j] = t;
+                }
+                list scattered;
+                init(&scattered, NULL);
+                for(size_t i = 0; i < n; i++) {
+                        nodes[i]->next = NULL;
+                        scattered.tail->next = nodes[i];
+                        scattered.tail = nodes[i];
+                }
+                free(nodes);
+
+                arena pool;
+                arenaInit(&pool, sizeof(node));
+                list packed;
+                init(&packed, &pool);
+                ulist unrolled;
+                initUnrolled(&unrolled);
+                for(size_t i = 0; i < n; i++) {
+                        insert(&packed, (int)i);
+                        insertUnrolled(&unrolled, (int)i);
+                }
+
+                const size_t scans = (BENCH_ELEMENTS / n > 0) ? BENCH_ELEMENTS / n : 1;
+                int found = 0;
+                double t0 = nowNs();
+                for(size_t s = 0; s < scans; s++) {
+                        found += find(&scattered, -1);
+                }
+                double t1 = nowNs();
+                for(size_t s = 0; s < scans; s++) {
+                        found += find(&packed, -1);
+                }
+                double t2 = nowNs();
+                for(size_t s = 0; s < scans; s++) {
+                        found += findUnrolled(&unrolled, -1);
+                }
+                double t3 = nowNs();
+                if(found != 0 || !find(&packed, (int)n - 1) || !findUnrolled(&unrolled, (int)n - 1)) {
+                        fprintf(stderr, "lists disagree\n");
+                        return 1;
+                }
+
+                const double per = (double)scans * n;
+                printf("%10zu %12zu %14.3f %14.3f %14.3f\n", n, n * sizeof(node) / 1024,
+                       (t1 - t0) / per, (t2 - t1) / per, (t3 - t2) / per);
+                clear(&scattered);
+                arenaDestroy(&pool);
+                arenaDestroy(&unrolled.nodes);
+        }
+        return 0;
+}
+// }}}
+
+int main(int argc, char **argv) {
+        if(argc > 1 && strcmp(argv[1], "bench") == 0) {
+                return bench();
+        }
+        /* initialization */
+        arena pool;
+        arenaInit(&pool, sizeof(node));
+        list start;
+        init(&start, &pool);
+
+        /* test harness */
+        insert(&start, 2);
+        delete(&start, 2);
+        int status = find(&start, 2);
+        if(status) {
+            printf("Element Found\n");
+        } else {
+            printf("Element Not Found\n");
+        }
+        insert(&start, 5);
+	insert(&start, 10);
+	insert(&start, 22);
+	insert(&start, 7);
+	insert(&start, 9);
+	insert(&start, 2);
+	insert(&start, 11);
+	insert(&start, 11);
+	insert(&start, 77);
+	insert(&start, 62);
+	insert(&start, 29);
+        status = find(&start, 5);
+        if(status) {
+            printf("Element Found\n");
+        } else {
+            printf("Element Not Found\n");
+        }
+        printf("The list is ");
+        print(&start);
+        printf("\n");
+        delete(&start, 5);
+        arenaDestroy(&pool);
+
+        /* the same with values packed into unrolled nodes */
+        ulist packed;
+        initUnrolled(&packed);
+        int values[] = {5, 10, 22, 7, 9, 2, 11, 11, 77, 62, 29, 3, 8, 41};
+        for(size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            insertUnrolled(&packed, values[i]);
+        }
+        deleteUnrolled(&packed, 11);
+        deleteUnrolled(&packed, 41);
+        printf("The unrolled list is ");
+        printUnrolled(&packed);
+        printf("\n");
+        printf("Element %s\n", findUnrolled(&packed, 8) ? "Found" : "Not Found");
+        arenaDestroy(&packed.nodes);
+}
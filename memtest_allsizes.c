@@ -1,7 +1,38 @@
 // memtest_allsizes.c
-// Compile: gcc -O2 -march=native -o memtest_allsizes memtest_allsizes.c
+// Compile: gcc -O2 -march=native -o memtest_allsizes memtest_allsizes.c -lm -pthread
 // Runs memcpy timing across multiple sizes and writes CSVs.
+//
+// Usage: memtest_allsizes [-t threads|all] [-n] [-s node] [-d node] [-c cpu] [-M]
+//                         [-H 4k|thp|2m|1g] [-T] [-R] [-P] [-e ci%]
+//                         [exponent] [engine,...|all]
+//   exponent: only test 2^exponent bytes (0 or missing: all sizes)
+//   engines:  libc (default), sse2, avx2, avx512, erms, nt
+//   -t:       bandwidth scaling with 1, 2, 4, ... up to threads concurrent
+//             threads, one per CPU ("all": every CPU we may run on)
+//   -n:       bandwidth scaling with one thread per NUMA node
+//   -s, -d:   bind the source / destination buffer to a NUMA node
+//   -c:       pin the measuring thread to a CPU
+//   -M:       copy latency matrix over all (source, destination) node pairs,
+//             measured from -c or else the first CPU of the source node
+//   -H:       back the buffers with 4 KiB (default), transparent huge or
+//             2 MiB / 1 GiB hugetlbfs pages
+//   -T:       TLB reach pointer chase with 4 KiB pages and the -H pages
+//   -R:       also dump every trial to a compact binary file, see write_raw()
+//   -P:       read hardware performance counters around every copy (see
+//             counters.h) and compare the outliers' counts with the rest
+//   -e:       repeat until the median's 95% confidence interval is within
+//             ci% of it (default 0.5, at most 200000 trials or 2 s per engine
+//             and size); 0 runs the fixed repeat_for_size() trials instead
+// Cycles are TSC ticks minus the calibrated timer overhead, ns use the
+// calibrated TSC frequency (see timing.h).
+// Every engine and size gets a latency histogram CSV
+// (memcpy[_<engine>]_2pow*_*b_hist.csv; bound buffers add _src<node> and
+// _dst<node>, huge pages _thp/_huge2m/_huge1g), every engine its statistics
+// and outlier analysis (memcpy[_<engine>]_performance_statistics.csv and
+// _outlier_analysis.csv) and the best engine per size is reported at the end. The scaling modes write memcpy_scaling.csv,
+// the matrix memcpy_numa_matrix.csv and the chase tlb_reach.csv.
 
+#define _GNU_SOURCE // sched_setaffinity, CPU_SET
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,58 +41,792 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
+#include <cpuid.h>
+#include <immintrin.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 
-// Flush one cache line containing p
-static inline void clflush_line(void *p) {
-	asm volatile("clflush (%0)" :: "r"(p));
-}
-
-// Serialize + rdtsc
-static inline uint64_t rdtsc_start(void) {
-	unsigned hi, lo;
-	asm volatile(
-	    "cpuid\n\t"
-	    "rdtsc\n\t"
-	    : "=a"(lo), "=d"(hi)
-	    : "a"(0)
-	    : "rbx", "rcx");
-	return ((uint64_t)hi << 32) | lo;
-}
-
-// rdtscp + serialize
-static inline uint64_t rdtsc_end(void) {
-	unsigned hi, lo;
-	asm volatile(
-	    "rdtscp\n\t"
-	    "mov %%eax, %0\n\t"
-	    "mov %%edx, %1\n\t"
-	    "cpuid\n\t"
-	    : "=r"(lo), "=r"(hi)
-	    :
-	    : "rax", "rbx", "rcx", "rdx");
-	return ((uint64_t)hi << 32) | lo;
-}
-
-// flush entire buffer by 64B steps
-void flush_buffer(void *buf, size_t size) {
-	const size_t line = 64;
-	volatile char *p = (volatile char *)buf;
-	for (size_t off = 0; off < size; off += line) {
-		clflush_line((void *)(p + off));
-	}
-	// ensure flush visible
-	asm volatile("mfence" ::: "memory");
-}
-
-int cmp_uint64(const void *a, const void *b) {
-	uint64_t va = *(const uint64_t *)a;
-	uint64_t vb = *(const uint64_t *)b;
-	if (va < vb)
-		return -1;
-	if (va > vb)
+#include "timing.h"
+#include "counters.h"
+#include "placement.h"
+
+// Copy engines. The hand-written loops move 64 B per iteration (the buffers
+// are 64 B aligned) and finish any tail with memcpy.
+typedef void (*copy_fn)(void *dst, const void *src, size_t size);
+
+static void copy_libc(void *dst, const void *src, size_t size) {
+	memcpy(dst, src, size);
+}
+
+__attribute__((target("sse2")))
+static void copy_sse2(void *dst, const void *src, size_t size) {
+	__m128i *d = (__m128i *)dst;
+	const __m128i *s = (const __m128i *)src;
+	size_t n = size / 64;
+	for (size_t i = 0; i < n; i++, d += 4, s += 4) {
+		__m128i a = _mm_load_si128(s);
+		__m128i b = _mm_load_si128(s + 1);
+		__m128i c = _mm_load_si128(s + 2);
+		__m128i e = _mm_load_si128(s + 3);
+		_mm_store_si128(d, a);
+		_mm_store_si128(d + 1, b);
+		_mm_store_si128(d + 2, c);
+		_mm_store_si128(d + 3, e);
+	}
+	memcpy(d, s, size % 64);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(void *dst, const void *src, size_t size) {
+	__m256i *d = (__m256i *)dst;
+	const __m256i *s = (const __m256i *)src;
+	size_t n = size / 64;
+	for (size_t i = 0; i < n; i++, d += 2, s += 2) {
+		__m256i a = _mm256_load_si256(s);
+		__m256i b = _mm256_load_si256(s + 1);
+		_mm256_store_si256(d, a);
+		_mm256_store_si256(d + 1, b);
+	}
+	memcpy(d, s, size % 64);
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(void *dst, const void *src, size_t size) {
+	char *d = (char *)dst;
+	const char *s = (const char *)src;
+	size_t n = size / 64;
+	for (size_t i = 0; i < n; i++, d += 64, s += 64) {
+		_mm512_store_si512(d, _mm512_load_si512(s));
+	}
+	memcpy(d, s, size % 64);
+}
+
+// Fast on CPUs with ERMS (and short copies with FSRM), see detect_engines()
+static void copy_erms(void *dst, const void *src, size_t size) {
+	asm volatile("rep movsb"
+	             : "+D"(dst), "+S"(src), "+c"(size)
+	             :
+	             : "memory");
+}
+
+// Streaming stores bypass the caches; the sfence makes them globally visible
+// before the end timestamp is taken
+__attribute__((target("sse2")))
+static void copy_nt(void *dst, const void *src, size_t size) {
+	__m128i *d = (__m128i *)dst;
+	const __m128i *s = (const __m128i *)src;
+	size_t n = size / 64;
+	for (size_t i = 0; i < n; i++, d += 4, s += 4) {
+		__m128i a = _mm_load_si128(s);
+		__m128i b = _mm_load_si128(s + 1);
+		__m128i c = _mm_load_si128(s + 2);
+		__m128i e = _mm_load_si128(s + 3);
+		_mm_stream_si128(d, a);
+		_mm_stream_si128(d + 1, b);
+		_mm_stream_si128(d + 2, c);
+		_mm_stream_si128(d + 3, e);
+	}
+	_mm_sfence();
+	memcpy(d, s, size % 64);
+}
+
+struct engine {
+	const char *name;
+	copy_fn copy;
+	int supported; // set by detect_engines()
+	int selected;
+};
+
+static struct engine engines[] = {
+	{"libc", copy_libc, 1, 0},
+	{"sse2", copy_sse2, 1, 0},
+	{"avx2", copy_avx2, 0, 0},
+	{"avx512", copy_avx512, 0, 0},
+	{"erms", copy_erms, 1, 0},
+	{"nt", copy_nt, 1, 0},
+};
+#define N_ENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+// rep movsb works everywhere, ERMS/FSRM only say whether it is fast
+static void detect_engines(void) {
+	unsigned a, b, c, d;
+	int erms = 0, fsrm = 0;
+	if (__get_cpuid_count(7, 0, &a, &b, &c, &d)) {
+		erms = (b >> 9) & 1;
+		fsrm = (d >> 4) & 1;
+	}
+	__builtin_cpu_init();
+	engines[2].supported = __builtin_cpu_supports("avx2") != 0;
+	engines[3].supported = __builtin_cpu_supports("avx512f") != 0;
+	printf("CPU: avx2=%d avx512f=%d erms=%d fsrm=%d\n",
+	       engines[2].supported, engines[3].supported, erms, fsrm);
+}
+
+// Selects the engines of a comma-separated list ("all": every supported one)
+static int select_engines(const char *list) {
+	char names[256];
+	snprintf(names, sizeof(names), "%s", list);
+	for (char *name = strtok(names, ","); name; name = strtok(NULL, ",")) {
+		int all = strcmp(name, "all") == 0;
+		int found = 0;
+		for (int e = 0; e < N_ENGINES; e++) {
+			if (all || strcmp(name, engines[e].name) == 0) {
+				found = 1;
+				if (engines[e].supported) {
+					engines[e].selected = 1;
+				} else if (!all) {
+					fprintf(stderr, "warning: engine %s is not supported by this CPU\n", name);
+				}
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "unknown engine %s\n", name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+struct summary {
+	uint64_t count; // 0: not measured
+	long double mean, stddev;
+	uint64_t min, p50, p90, p99, p999, max;
+	// values outside the 1.5 IQR fences, as in memcpy_outlier_analysis.csv
+	double lower, upper;
+	uint64_t n_outliers, min_outlier, max_outlier;
+};
+
+static void summarize(const struct histogram *h, struct summary *s) {
+	s->count = h->total;
+	s->mean = h->sum / (long double)h->total;
+	long double variance = h->sum_squares / (long double)h->total - s->mean * s->mean;
+	s->stddev = sqrtl(variance > 0 ? variance : 0);
+	s->min = h->min;
+	s->p50 = hist_percentile(h, 50);
+	s->p90 = hist_percentile(h, 90);
+	s->p99 = hist_percentile(h, 99);
+	s->p999 = hist_percentile(h, 99.9);
+	s->max = h->max;
+
+	double q1 = (double)hist_percentile(h, 25), q3 = (double)hist_percentile(h, 75);
+	s->lower = q1 - 1.5 * (q3 - q1);
+	s->upper = q3 + 1.5 * (q3 - q1);
+	s->n_outliers = 0;
+	s->min_outlier = 0;
+	s->max_outlier = 0;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		double v = (double)hist_value(i);
+		if (h->counts[i] != 0 && (v < s->lower || v > s->upper)) {
+			if (s->n_outliers == 0) {
+				s->min_outlier = (v < s->lower) ? h->min : hist_value(i);
+			}
+			s->n_outliers += h->counts[i];
+			s->max_outlier = (v > s->upper) ? h->max : hist_value(i);
+		}
+	}
+}
+
+// Writes the non-empty buckets as low,high,count (high exclusive)
+static void hist_write_csv(const struct histogram *h, const char *fname) {
+	FILE *f = fopen(fname, "w");
+	if (!f) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		exit(1);
+	}
+	fprintf(f, "low,high,count\n");
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		if (h->counts[i] != 0) {
+			uint64_t width = (i < HIST_LINEAR) ? 1 :
+			                 (uint64_t)1 << (((i - HIST_LINEAR) >> HIST_SUB_BITS) + 1);
+			uint64_t low = hist_value(i) - (width - 1) / 2;
+			fprintf(f, "%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n", low, low + width, h->counts[i]);
+		}
+	}
+	fclose(f);
+}
+
+// Keep every trial for a raw dump next to the histogram (-R)
+static int raw_dump = 0;
+
+// Performance counters read around every copy (-P, empty without)
+static struct pmc_set pmcs;
+
+static void write_varint(uint64_t v, FILE *f) {
+	do {
+		unsigned char byte = v & 0x7f;
+		v >>= 7;
+		fputc(byte | (v ? 0x80 : 0), f);
+	} while (v);
+}
+
+// Raw per-trial dump (-R): the 8 bytes "MCPYRAW1", the number of trials as a
+// little-endian uint64, then every trial's cycles as an unsigned LEB128
+// varint (2 bytes for most copies). With counters (deltas not NULL) it is
+// "MCPYRAW2", the count, one byte with the number of columns, their
+// NUL-terminated names ("cycles" and the counters) and then per trial the
+// cycles followed by each counter's delta, all varints.
+static void write_raw(const uint64_t *results, const uint64_t *deltas, size_t n,
+                      const char *fname) {
+	FILE *f = fopen(fname, "wb");
+	if (!f) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		exit(1);
+	}
+	uint64_t count = n;
+	unsigned char le[8];
+	for (int i = 0; i < 8; i++) {
+		le[i] = (unsigned char)(count >> (8 * i));
+	}
+	fwrite(deltas ? "MCPYRAW2" : "MCPYRAW1", 1, 8, f);
+	fwrite(le, 1, 8, f);
+	if (deltas) {
+		fputc(1 + pmcs.n, f);
+		fwrite("cycles", 1, 7, f);
+		for (int c = 0; c < pmcs.n; c++) {
+			fwrite(pmcs.pmc[c].name, 1, strlen(pmcs.pmc[c].name) + 1, f);
+		}
+	}
+	for (size_t i = 0; i < n; i++) {
+		write_varint(results[i], f);
+		for (int c = 0; deltas && c < pmcs.n; c++) {
+			write_varint(deltas[i * pmcs.n + c], f);
+		}
+	}
+	fclose(f);
+}
+
+// Output file names: memcpy[_<engine>]_<stem><label><suffix>, libc keeps the
+// original names without the engine
+static void output_name(char *fname, size_t len, const struct engine *engine,
+                        const char *stem, const char *label, const char *suffix) {
+	if (strcmp(engine->name, "libc") == 0) {
+		snprintf(fname, len, "memcpy_%s%s%s", stem, label, suffix);
+	} else {
+		snprintf(fname, len, "memcpy_%s_%s%s%s", engine->name, stem, label, suffix);
+	}
+}
+
+// Times copies with both buffers flushed before each one into a histogram
+// until reps says so, writes it (and with -R the raw trials, kept in results
+// with room for reps->max_reps when it is not NULL) and prints the summary
+// line. label goes into the file names. With counters deltas (room for
+// reps->max_reps * pmcs.n) gets their per-copy counts and the outliers are
+// attributed to them.
+static void measure_engine(const struct engine *engine, int x, const char *label,
+                           void *buf, void *bufcopy, size_t size,
+                           const struct adaptive *reps, struct histogram *hist,
+                           uint64_t *results, uint64_t *deltas, struct summary *summary) {
+	// Warm-up: do a few copies to avoid cold-start anomalies
+	for (int w = 0; w < 5; ++w) {
+		engine->copy(bufcopy, buf, size);
+	}
+	if (memcmp(bufcopy, buf, size) != 0) {
+		fprintf(stderr, "engine %s copied %zu B wrong\n", engine->name, size);
+		exit(1);
+	}
+	// flush so next reads go to DRAM
+	flush_buffer(buf, size);
+	flush_buffer(bufcopy, size);
+
+	// main measurement loop, in batches until the median is tight enough
+	hist_reset(hist);
+	size_t rep = 0;
+	uint64_t before[PMC_MAX], after[PMC_MAX];
+	uint64_t begin = rdtsc_start();
+	do {
+		for (size_t i = 0; i < reps->batch && rep < reps->max_reps; ++i, ++rep) {
+			// flush both buffers to force DRAM accesses (and not use cached data)
+			flush_buffer(buf, size);
+			flush_buffer(bufcopy, size);
+
+			pmc_read(&pmcs, before);
+			uint64_t t0 = rdtsc_start();
+			engine->copy(bufcopy, buf, size);
+			uint64_t t1 = rdtsc_end();
+			pmc_read(&pmcs, after);
+
+			hist_record(hist, elapsed(t0, t1));
+			if (results) {
+				results[rep] = elapsed(t0, t1);
+			}
+			for (int c = 0; deltas && c < pmcs.n; c++) {
+				deltas[rep * pmcs.n + c] = after[c] - before[c];
+			}
+			// minimal disturbance between iterations
+		}
+	} while (!adaptive_done(reps, hist, rep, rdtsc_end() - begin));
+
+	char stem[64], fname[256];
+	snprintf(stem, sizeof(stem), "2pow%d_%zub", x, size);
+	output_name(fname, sizeof(fname), engine, stem, label, "_hist.csv");
+	hist_write_csv(hist, fname);
+	printf("Wrote histogram CSV: %s\n", fname);
+	if (results && raw_dump) {
+		output_name(fname, sizeof(fname), engine, stem, label, ".bin");
+		write_raw(results, deltas, rep, fname);
+		printf("Wrote raw trials: %s\n", fname);
+	}
+
+	summarize(hist, summary);
+	printf("%s size=%zu B: mean=%.2Lf cycles, median=%" PRIu64 ", std=%.2Lf, min=%" PRIu64
+	       ", p90=%" PRIu64 ", p99=%" PRIu64 ", p99.9=%" PRIu64 ", max=%" PRIu64 "\n",
+	       engine->name, size, summary->mean, summary->p50, summary->stddev, summary->min,
+	       summary->p90, summary->p99, summary->p999, summary->max);
+	printf("%s size=%zu B: median=%.1f ns +-%.2f%% after %zu trials\n", engine->name, size,
+	       cycles_to_ns(summary->p50), 100.0 * hist_median_ci(hist), rep);
+	if (deltas) {
+		pmc_attribute(&pmcs, results, deltas, rep, summary->upper);
+	}
+}
+
+// Writes the memcpy_performance_statistics.csv columns of engine e over the
+// measured sizes
+static void write_statistics(const struct engine *engine, const char *label, const int *exponents,
+                             int start_idx, int end_idx, int e,
+                             struct summary (*summaries)[N_ENGINES]) {
+	char fname[256];
+	output_name(fname, sizeof(fname), engine, "performance_statistics", label, ".csv");
+	FILE *f = fopen(fname, "w");
+	if (!f) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		exit(1);
+	}
+	fprintf(f, "size_bytes,cycles_mean,cycles_std,cycles_min,cycles_max,cycles_median,"
+	        "latency_ns_mean,latency_ns_std,latency_ns_median\n");
+	for (int si = start_idx; si <= end_idx; ++si) {
+		const struct summary *s = &summaries[si][e];
+		fprintf(f, "%zu,%.2Lf,%.2Lf,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.2f,%.2f,%.2f\n",
+		        (size_t)1 << exponents[si], s->mean, s->stddev, s->min, s->max, s->p50,
+		        cycles_to_ns(s->mean), cycles_to_ns(s->stddev), cycles_to_ns(s->p50));
+	}
+	fclose(f);
+	printf("Wrote statistics: %s\n", fname);
+}
+
+// Writes the outlier analysis of engine e over the measured sizes
+static void write_outliers(const struct engine *engine, const char *label, const int *exponents,
+                           int start_idx, int end_idx, int e,
+                           struct summary (*summaries)[N_ENGINES]) {
+	char fname[256];
+	output_name(fname, sizeof(fname), engine, "outlier_analysis", label, ".csv");
+	FILE *f = fopen(fname, "w");
+	if (!f) {
+		fprintf(stderr, "failed to open %s for writing\n", fname);
+		exit(1);
+	}
+	fprintf(f, "exponent,size_bytes,n_outliers,outlier_percentage,max_outlier,min_outlier,"
+	        "normal_range_lower,normal_range_upper\n");
+	for (int si = start_idx; si <= end_idx; ++si) {
+		const struct summary *s = &summaries[si][e];
+		fprintf(f, "%d,%zu,%" PRIu64 ",%.4f,%" PRIu64 ",%" PRIu64 ",%.1f,%.1f\n",
+		        exponents[si], (size_t)1 << exponents[si], s->n_outliers,
+		        100.0 * (double)s->n_outliers / (double)s->count, s->max_outlier,
+		        s->min_outlier, s->lower, s->upper);
+	}
+	fclose(f);
+	printf("Wrote outlier analysis: %s\n", fname);
+}
+
+// REPEAT for copies of size bytes (avoid too many loops for large copies)
+static size_t repeat_for_size(size_t size) {
+	if (size <= 4096)
+		return 200000;          // many trials for small copies
+	else if (size <= 65536)
+		return 50000;
+	else if (size <= 262144)
+		return 20000;   // 256KB
+	else if (size <= 1048576)
+		return 8000;   // 1MB
+	else
+		return 2000;                        // 2MB etc.
+}
+
+// Relative half width of the median's confidence interval to stop at (-e)
+static double ci_target = 0.005;
+
+// NUMA and page placement, see placement.h {{{
+// CPUs this process may run on, in order
+static int allowed_cpus(int *cpus, int max) {
+	cpu_set_t set;
+	int n = 0;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		cpus[0] = 0;
 		return 1;
-	return 0;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[n++] = cpu;
+		}
+	}
+	return n;
+}
+
+// CSV name suffix of the page mode ("" for 4 KiB pages)
+static const char *page_label(void) {
+	static const char *labels[] = {"", "_thp", "_huge2m", "_huge1g"};
+	return labels[page_mode];
+}
+// }}}
+
+// TLB reach {{{
+// One load per 4 KiB stride of a buffer, in a random cyclic order, each at a
+// random line offset so the n lines spread over the cache sets even when the
+// pages are physically contiguous (stride % 64 would not). On 4 KiB
+// pages every load needs its own TLB entry, on huge pages the same n lines
+// need a few: the same cache footprint with a different TLB footprint, so
+// the gap between the page modes is the translation cost.
+static double chase_cycles(size_t n, int node) {
+	size_t size = n * 4096;
+	char *buf = alloc_buffer(size, node);
+	size_t *order = malloc(sizeof(size_t) * n);
+	size_t *line = malloc(sizeof(size_t) * n);
+	if (!buf || !order || !line) {
+		fprintf(stderr, "buffer allocation failed (%zu B)\n", size);
+		exit(1);
+	}
+	uint64_t x = 88172645463325252ULL; // xorshift64
+	for (size_t i = 0; i < n; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		order[i] = i;
+		line[i] = i * 4096 + (x % 64) * 64;
+	}
+	for (size_t i = n - 1; i > 0; i--) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		size_t j = x % (i + 1);
+		size_t t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for (size_t i = 0; i < n; i++) {
+		*(void **)(buf + line[order[i]]) = buf + line[order[(i + 1) % n]];
+	}
+
+	void **p = (void **)(buf + line[order[0]]);
+	for (size_t i = 0; i < n; i++) {
+		p = (void **)*p;
+	}
+	size_t loads = (n * 8 > ((size_t)1 << 20)) ? n * 8 : (size_t)1 << 20;
+	uint64_t t0 = rdtsc_start();
+	for (size_t i = 0; i < loads; i++) {
+		p = (void **)*p;
+	}
+	uint64_t t1 = rdtsc_end();
+	asm volatile("" :: "r"(p));
+	t1 -= timer_overhead();
+
+	free(order);
+	free(line);
+	free_buffer(buf, size, node);
+	return (double)(t1 - t0) / (double)loads;
+}
+
+// Cycles per load from 16 strides (64 KiB) to 64 Ki strides (256 MiB)
+static void run_tlb_reach(int node) {
+	enum page_mode modes[2] = {PAGES_4K, page_mode};
+	int n_modes = (page_mode == PAGES_4K) ? 1 : 2;
+	enum page_mode requested = page_mode;
+
+	FILE *csv = fopen("tlb_reach.csv", "w");
+	if (!csv) {
+		fprintf(stderr, "failed to open tlb_reach.csv for writing\n");
+		exit(1);
+	}
+	fprintf(csv, "pages,strides,working_set,cycles_per_load\n");
+	printf("=== TLB reach: cycles per load, one load per 4 KiB stride ===\n");
+	printf("%10s %12s", "strides", "span");
+	for (int m = 0; m < n_modes; m++) {
+		printf(" %10s", page_mode_names[modes[m]]);
+	}
+	printf("\n");
+	for (size_t n = 16; n <= 65536; n *= 2) {
+		printf("%10zu %10zu K", n, n * 4);
+		for (int m = 0; m < n_modes; m++) {
+			page_mode = modes[m];
+			double cycles = chase_cycles(n, node);
+			printf(" %10.2f", cycles);
+			fprintf(csv, "%s,%zu,%zu,%.3f\n", page_mode_names[page_mode], n, n * 4096, cycles);
+		}
+		printf("\n");
+	}
+	page_mode = requested;
+	fclose(csv);
+	printf("Wrote TLB reach CSV: tlb_reach.csv\n");
 }
+// }}}
+
+// Runs every selected engine on one size with the buffers on src_node and
+// dst_node; summaries[e] gets each engine's summary
+static void sweep_size(int x, int src_node, int dst_node, const char *label,
+                       struct summary *summaries) {
+	size_t size = (size_t)1 << x;
+	struct adaptive reps = {1000, 200000, 1000, ci_target, 2e9};
+	if (ci_target == 0) {
+		reps.min_reps = reps.max_reps = reps.batch = repeat_for_size(size);
+	}
+	size_t REPEAT = reps.max_reps;
+
+	printf("=== Testing 2^%d = %zu B, REPEAT<=%zu ===\n", x, size, REPEAT);
+
+	// allocate aligned buffers
+	void *buf = alloc_buffer(size, src_node);
+	void *bufcopy = alloc_buffer(size, dst_node);
+	if (!buf || !bufcopy) {
+		fprintf(stderr, "buffer allocation failed\n");
+		exit(1);
+	}
+	// init
+	memset(buf, 0x5A, size);
+	memset(bufcopy, 0xA5, size);
+
+	// histogram, and the raw results array for -R and the counters (-P)
+	struct histogram *hist = malloc(sizeof(struct histogram));
+	const int keep = raw_dump || pmcs.n > 0;
+	uint64_t *results = keep ? malloc(sizeof(uint64_t) * REPEAT) : NULL;
+	uint64_t *deltas = pmcs.n ? malloc(sizeof(uint64_t) * REPEAT * pmcs.n) : NULL;
+	if (!hist || (keep && !results) || (pmcs.n && !deltas)) {
+		fprintf(stderr, "malloc results fail\n");
+		exit(1);
+	}
+
+	for (int e = 0; e < N_ENGINES; e++) {
+		if (engines[e].selected) {
+			measure_engine(&engines[e], x, label, buf, bufcopy, size, &reps,
+			               hist, results, deltas, &summaries[e]);
+		}
+	}
+
+	free(hist);
+	free(results);
+	free(deltas);
+	free_buffer(buf, size, src_node);
+	free_buffer(bufcopy, size, dst_node);
+}
+
+// Median copy cycles for every (source, destination) node pair, one matrix
+// per engine and size
+static void run_matrix(const int *exponents, int start_idx, int end_idx, int cpu) {
+	int nodes[64], node_cpus[64];
+	int n_nodes = numa_nodes(nodes, node_cpus, 64);
+	static uint64_t medians[64][64][N_ENGINES];
+	struct summary summaries[N_ENGINES];
+
+	FILE *csv = fopen("memcpy_numa_matrix.csv", "w");
+	if (!csv) {
+		fprintf(stderr, "failed to open memcpy_numa_matrix.csv for writing\n");
+		exit(1);
+	}
+	fprintf(csv, "engine,size,cpu,src_node,dst_node,median\n");
+
+	for (int si = start_idx; si <= end_idx; ++si) {
+		int x = exponents[si];
+		for (int i = 0; i < n_nodes; i++) {
+			int measuring_cpu = (cpu >= 0) ? cpu : node_cpus[i];
+			pin_to_cpu(measuring_cpu);
+			for (int j = 0; j < n_nodes; j++) {
+				char label[64];
+				snprintf(label, sizeof(label), "_src%d_dst%d%s", nodes[i], nodes[j], page_label());
+				sweep_size(x, nodes[i], nodes[j], label, summaries);
+				for (int e = 0; e < N_ENGINES; e++) {
+					if (engines[e].selected) {
+						medians[i][j][e] = summaries[e].p50;
+						fprintf(csv, "%s,%zu,%d,%d,%d,%" PRIu64 "\n", engines[e].name,
+						        (size_t)1 << x, measuring_cpu, nodes[i], nodes[j], medians[i][j][e]);
+					}
+				}
+			}
+		}
+
+		for (int e = 0; e < N_ENGINES; e++) {
+			if (!engines[e].selected) {
+				continue;
+			}
+			printf("\n=== %s size=%zu B: median cycles, source node (rows) x destination node ===\n",
+			       engines[e].name, (size_t)1 << x);
+			printf("%8s", "");
+			for (int j = 0; j < n_nodes; j++) {
+				printf(" %10d", nodes[j]);
+			}
+			printf("\n");
+			for (int i = 0; i < n_nodes; i++) {
+				double remote = 0.0;
+				printf("%8d", nodes[i]);
+				for (int j = 0; j < n_nodes; j++) {
+					printf(" %10" PRIu64, medians[i][j][e]);
+					if (j != i) {
+						remote += (double)medians[i][j][e] / (n_nodes - 1);
+					}
+				}
+				if (n_nodes > 1) {
+					printf("   (remote/local: %.2fx)", remote / (double)medians[i][i][e]);
+				}
+				printf("\n");
+			}
+		}
+	}
+	fclose(csv);
+	printf("Wrote NUMA matrix CSV: memcpy_numa_matrix.csv\n");
+}
+
+// Bandwidth scaling {{{
+// Every thread pins itself, then allocates and touches its buffers so they
+// are local to its node, and starts copying when all threads are ready.
+struct worker {
+	pthread_t thread;
+	int cpu;
+	const struct engine *engine;
+	size_t size;
+	size_t repeat;
+	pthread_barrier_t *start;
+	struct histogram *hist; // cycles of every copy
+	uint64_t busy;          // sum of them
+};
+
+static void *worker_main(void *arg) {
+	struct worker *w = (struct worker *)arg;
+	pin_to_cpu(w->cpu);
+
+	void *buf = alloc_buffer(w->size, -1);
+	void *bufcopy = alloc_buffer(w->size, -1);
+	if (!buf || !bufcopy) {
+		fprintf(stderr, "buffer allocation failed\n");
+		exit(1);
+	}
+	memset(buf, 0x5A, w->size);
+	memset(bufcopy, 0xA5, w->size);
+	for (int i = 0; i < 5; ++i) {
+		w->engine->copy(bufcopy, buf, w->size);
+	}
+
+	pthread_barrier_wait(w->start);
+	hist_reset(w->hist);
+	w->busy = 0;
+	for (size_t rep = 0; rep < w->repeat; ++rep) {
+		flush_buffer(buf, w->size);
+		flush_buffer(bufcopy, w->size);
+
+		uint64_t t0 = rdtsc_start();
+		w->engine->copy(bufcopy, buf, w->size);
+		uint64_t t1 = rdtsc_end();
+
+		hist_record(w->hist, elapsed(t0, t1));
+		w->busy += elapsed(t0, t1);
+	}
+
+	free_buffer(buf, w->size, -1);
+	free_buffer(bufcopy, w->size, -1);
+	return NULL;
+}
+
+// Runs the size sweep with 1, 2, 4, ... max_threads concurrent threads pinned
+// to cpus (round robin). A thread's bandwidth is its bytes over the time it
+// spent copying (the flushes in between are not counted); the aggregate is
+// the sum over the threads. Bandwidth saturates at the first thread count
+// within 5% of the best aggregate.
+static void run_scaling(const int *exponents, int start_idx, int end_idx,
+                        const int *cpus, int n_cpus, int max_threads) {
+	int counts[64], n_counts = 0;
+	for (int t = 1; t < max_threads && n_counts < 63; t *= 2) {
+		counts[n_counts++] = t;
+	}
+	counts[n_counts++] = max_threads;
+
+	double hz = tsc_hz();
+
+	FILE *csv = fopen("memcpy_scaling.csv", "w");
+	if (!csv) {
+		fprintf(stderr, "failed to open memcpy_scaling.csv for writing\n");
+		exit(1);
+	}
+	fprintf(csv, "engine,size,threads,thread,cpu,p50,p90,p99,thread_gbps,aggregate_gbps\n");
+
+	struct worker *workers = calloc(max_threads, sizeof(struct worker));
+	if (!workers) {
+		fprintf(stderr, "calloc workers fail\n");
+		exit(1);
+	}
+	for (int e = 0; e < N_ENGINES; e++) {
+		if (!engines[e].selected) {
+			continue;
+		}
+		for (int si = start_idx; si <= end_idx; ++si) {
+			size_t size = (size_t)1 << exponents[si];
+			size_t repeat = repeat_for_size(size) / 10;
+			double aggregate[64];
+
+			for (int c = 0; c < n_counts; c++) {
+				int n_threads = counts[c];
+				pthread_barrier_t start;
+				pthread_barrier_init(&start, NULL, n_threads);
+				for (int t = 0; t < n_threads; t++) {
+					struct worker *w = &workers[t];
+					w->cpu = cpus[t % n_cpus];
+					w->engine = &engines[e];
+					w->size = size;
+					w->repeat = repeat;
+					w->start = &start;
+					w->hist = malloc(sizeof(struct histogram));
+					if (!w->hist) {
+						fprintf(stderr, "malloc results fail\n");
+						exit(1);
+					}
+					if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+						fprintf(stderr, "pthread_create failed\n");
+						exit(1);
+					}
+				}
+				aggregate[c] = 0.0;
+				for (int t = 0; t < n_threads; t++) {
+					pthread_join(workers[t].thread, NULL);
+					aggregate[c] += (double)(size * repeat) * hz / (double)workers[t].busy / 1e9;
+				}
+				pthread_barrier_destroy(&start);
+
+				printf("%s size=%zu B threads=%d: %.2f GB/s aggregate\n",
+				       engines[e].name, size, n_threads, aggregate[c]);
+				for (int t = 0; t < n_threads; t++) {
+					struct worker *w = &workers[t];
+					double gbps = (double)(size * repeat) * hz / (double)w->busy / 1e9;
+					uint64_t p50 = hist_percentile(w->hist, 50);
+					uint64_t p90 = hist_percentile(w->hist, 90);
+					uint64_t p99 = hist_percentile(w->hist, 99);
+					printf("  thread %d (cpu %d): %.2f GB/s, p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64 " cycles\n",
+					       t, w->cpu, gbps, p50, p90, p99);
+					fprintf(csv, "%s,%zu,%d,%d,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f,%.3f\n",
+					        engines[e].name, size, n_threads, t, w->cpu, p50, p90, p99, gbps, aggregate[c]);
+					free(w->hist);
+				}
+			}
+
+			int peak = 0;
+			for (int c = 1; c < n_counts; c++) {
+				if (aggregate[c] > aggregate[peak]) {
+					peak = c;
+				}
+			}
+			int saturation = peak;
+			for (int c = 0; c < peak; c++) {
+				if (aggregate[c] >= 0.95 * aggregate[peak]) {
+					saturation = c;
+					break;
+				}
+			}
+			printf("%s size=%zu B: saturates at %d threads (%.2f GB/s, peak %.2f GB/s at %d)\n",
+			       engines[e].name, size, counts[saturation], aggregate[saturation],
+			       aggregate[peak], counts[peak]);
+		}
+	}
+	free(workers);
+	fclose(csv);
+	printf("Wrote scaling CSV: memcpy_scaling.csv\n");
+}
+// }}}
 
 int main(int argc, char **argv) {
 	// Sizes to test: 2^6 .. 2^16, 2^20, 2^21
@@ -69,6 +834,68 @@ int main(int argc, char **argv) {
 	int exponents[] = {6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 20, 21};
 	int n_sizes = sizeof(exponents) / sizeof(exponents[0]);
 
+	// Bandwidth scaling and placement options
+	static int cpus[CPU_SETSIZE], nodes[CPU_SETSIZE];
+	int n_cpus = 0, max_threads = 0;
+	int src_node = -1, dst_node = -1, cpu = -1, matrix = 0, tlb_reach = 0, use_counters = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t:ns:d:c:MH:TRPe:")) != -1) {
+		switch (opt) {
+		case 't':
+			n_cpus = allowed_cpus(cpus, CPU_SETSIZE);
+			max_threads = (strcmp(optarg, "all") == 0) ? n_cpus : atoi(optarg);
+			break;
+		case 'n':
+			n_cpus = numa_nodes(nodes, cpus, CPU_SETSIZE);
+			max_threads = n_cpus;
+			break;
+		case 's':
+			src_node = atoi(optarg);
+			break;
+		case 'd':
+			dst_node = atoi(optarg);
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			break;
+		case 'M':
+			matrix = 1;
+			break;
+		case 'H':
+			if (!parse_page_mode(optarg)) {
+				fprintf(stderr, "unknown page size %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'T':
+			tlb_reach = 1;
+			break;
+		case 'R':
+			raw_dump = 1;
+			break;
+		case 'P':
+			use_counters = 1;
+			break;
+		case 'e':
+			ci_target = atof(optarg) / 100.0;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-t threads|all] [-n] [-s node] [-d node] [-c cpu] [-M]"
+			        " [-H 4k|thp|2m|1g] [-T] [-R] [-P] [-e ci%%] [exponent] [engine,...|all]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (n_cpus > 0 && max_threads <= 0) {
+		fprintf(stderr, "-t needs a positive thread count\n");
+		exit(1);
+	}
+	if (max_threads > n_cpus) {
+		fprintf(stderr, "warning: %d threads share %d CPUs, the aggregate is not a bandwidth\n",
+		        max_threads, n_cpus);
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	// Optional: permit override via command line to test subset or single exponent
 	int start_idx = 0, end_idx = n_sizes - 1;
 	if (argc >= 2) {
@@ -89,6 +916,19 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	detect_engines();
+	print_calibration();
+	if (use_counters) {
+		pmc_open(&pmcs);
+	}
+	if (!select_engines(argc >= 3 ? argv[2] : "libc")) {
+		exit(1);
+	}
+	if (max_threads > 0) {
+		run_scaling(exponents, start_idx, end_idx, cpus, n_cpus, max_threads);
+		return 0;
+	}
+
 	// Lock memory to reduce paging jitter
 	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
 		fprintf(stderr, "warning: mlockall failed: %s\n", strerror(errno));
@@ -96,116 +936,56 @@ int main(int argc, char **argv) {
 		printf("mlockall OK\n");
 	}
 
-	// For each size, choose REPEAT adaptively (avoid too many loops for large copies)
-	for (int si = start_idx; si <= end_idx; ++si) {
-		int x = exponents[si];
-		size_t size = (size_t)1 << x;
-		size_t REPEAT;
-
-		if (size <= 4096)
-			REPEAT = 200000;          // many trials for small copies
-		else if (size <= 65536)
-			REPEAT = 50000;
-		else if (size <= 262144)
-			REPEAT = 20000;   // 256KB
-		else if (size <= 1048576)
-			REPEAT = 8000;   // 1MB
-		else
-			REPEAT = 2000;                        // 2MB etc.
-
-		printf("=== Testing 2^%d = %zu B, REPEAT=%zu ===\n", x, size, REPEAT);
-
-		// allocate aligned buffers
-		void *buf = NULL, *bufcopy = NULL;
-		if (posix_memalign(&buf, 64, size) != 0) {
-			fprintf(stderr, "posix_memalign buf failed\n");
-			exit(1);
-		}
-		if (posix_memalign(&bufcopy, 64, size) != 0) {
-			fprintf(stderr, "posix_memalign bufcopy failed\n");
-			exit(1);
-		}
-		// init
-		memset(buf, 0x5A, size);
-		memset(bufcopy, 0xA5, size);
-
-		// allocate results array
-		uint64_t *results = malloc(sizeof(uint64_t) * REPEAT);
-		if (!results) {
-			fprintf(stderr, "malloc results fail\n");
-			exit(1);
-		}
-
-		// Warm-up: do a few copies to avoid cold-start anomalies
-		for (int w = 0; w < 5; ++w) {
-			memcpy(bufcopy, buf, size);
-		}
-		// flush so next reads go to DRAM
-		flush_buffer(buf, size);
-		flush_buffer(bufcopy, size);
-
-		// main measurement loop
-		for (size_t rep = 0; rep < REPEAT; ++rep) {
-			// flush both buffers to force DRAM accesses (and not use cached data)
-			flush_buffer(buf, size);
-			flush_buffer(bufcopy, size);
-
-			uint64_t t0 = rdtsc_start();
-			memcpy(bufcopy, buf, size);
-			uint64_t t1 = rdtsc_end();
+	if (matrix) {
+		run_matrix(exponents, start_idx, end_idx, cpu);
+		return 0;
+	}
+	if (cpu >= 0) {
+		pin_to_cpu(cpu);
+	}
+	if (tlb_reach) {
+		run_tlb_reach(src_node);
+		return 0;
+	}
+	char label[64] = "";
+	if (src_node >= 0) {
+		snprintf(label, sizeof(label), "_src%d", src_node);
+	}
+	if (dst_node >= 0) {
+		snprintf(label + strlen(label), sizeof(label) - strlen(label), "_dst%d", dst_node);
+	}
+	snprintf(label + strlen(label), sizeof(label) - strlen(label), "%s", page_label());
 
-			results[rep] = (t1 - t0);
-			// minimal disturbance between iterations
-		}
+	// summaries[si][e] for the reports at the end (count 0: not measured)
+	static struct summary summaries[sizeof(exponents) / sizeof(exponents[0])][N_ENGINES];
 
-		// Write CSV file
-		char fname[256];
-		snprintf(fname, sizeof(fname), "memcpy_2pow%d_%zub.csv", x, size);
-		FILE *f = fopen(fname, "w");
-		if (!f) {
-			fprintf(stderr, "failed to open %s for writing\n", fname);
-			exit(1);
-		}
-		fprintf(f, "rep,cycles\n");
-		for (size_t i = 0; i < REPEAT; i++) {
-			fprintf(f, "%zu,%" PRIu64 "\n", i, results[i]);
+	// For each size, choose REPEAT adaptively (avoid too many loops for large copies)
+	for (int si = start_idx; si <= end_idx; ++si) {
+		sweep_size(exponents[si], src_node, dst_node, label, summaries[si]);
+	}
+	for (int e = 0; e < N_ENGINES; e++) {
+		if (engines[e].selected) {
+			write_statistics(&engines[e], label, exponents, start_idx, end_idx, e, summaries);
+			write_outliers(&engines[e], label, exponents, start_idx, end_idx, e, summaries);
 		}
-		fclose(f);
-		printf("Wrote per-trial CSV: %s\n", fname);
+	}
 
-		// compute stats
-		// copy results for sorting
-		uint64_t *sorted = malloc(sizeof(uint64_t) * REPEAT);
-		if (!sorted) {
-			fprintf(stderr, "malloc sorted fail\n");
-			exit(1);
+	// Best engine per size (by median)
+	printf("\n=== Best engine per size (median cycles) ===\n");
+	for (int si = start_idx; si <= end_idx; ++si) {
+		int best = -1;
+		for (int e = 0; e < N_ENGINES; e++) {
+			if (summaries[si][e].count != 0 &&
+			    (best < 0 || summaries[si][e].p50 < summaries[si][best].p50)) {
+				best = e;
+			}
 		}
-		memcpy(sorted, results, sizeof(uint64_t) * REPEAT);
-		qsort(sorted, REPEAT, sizeof(uint64_t), cmp_uint64);
-
-		// mean, std, min, max, median
-		long double sum = 0.0L;
-		for (size_t i = 0; i < REPEAT; i++)
-			sum += (long double)results[i];
-		long double mean = sum / (long double)REPEAT;
-		long double ssum = 0.0L;
-		for (size_t i = 0; i < REPEAT; i++) {
-			long double d = (long double)results[i] - mean;
-			ssum += d * d;
+		if (best >= 0) {
+			printf("size=%zu B: %s (median=%" PRIu64 ")\n", (size_t)1 << exponents[si],
+			       engines[best].name, summaries[si][best].p50);
 		}
-		long double stddev = sqrt(ssum / (long double)REPEAT);
-		uint64_t minv = sorted[0];
-		uint64_t maxv = sorted[REPEAT - 1];
-		uint64_t median = (REPEAT % 2 == 0) ? sorted[REPEAT / 2] : sorted[REPEAT / 2];
-
-		printf("size=%zu B: mean=%.2Lf cycles, median=%" PRIu64 ", std=%.2Lf, min=%" PRIu64 ", max=%" PRIu64 "\n",
-		       size, mean, median, stddev, minv, maxv);
-
-		free(sorted);
-		free(results);
-		free(buf);
-		free(bufcopy);
 	}
 
+	pmc_close(&pmcs);
 	return 0;
 }
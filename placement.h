@@ -0,0 +1,214 @@
+// placement.h
+// NUMA and page placement shared by memtest_allsizes.c and dram_row_policy.c:
+// CPU pinning, the NUMA nodes from sysfs, buffers bound to a node with mbind
+// and backed by 4 KiB, transparent huge or hugetlbfs pages (page_mode, -H).
+// The includer defines _GNU_SOURCE (sched_setaffinity, MAP_HUGETLB).
+// Everything is static so each benchmark stays a single translation unit.
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static void pin_to_cpu(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		fprintf(stderr, "warning: cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+	}
+}
+
+// NUMA nodes and their first CPU, from sysfs (node 0 without it)
+static int numa_nodes(int *nodes, int *cpus, int max) {
+	int n = 0;
+	for (int node = 0; node < 1024 && n < max; node++) {
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		FILE *f = fopen(path, "r");
+		if (!f) {
+			continue;
+		}
+		int cpu;
+		if (fscanf(f, "%d", &cpu) == 1) {
+			nodes[n] = node;
+			cpus[n++] = cpu;
+		}
+		fclose(f);
+	}
+	if (n == 0) {
+		nodes[0] = 0;
+		cpus[n++] = 0;
+	}
+	return n;
+}
+
+// NUMA placement without libnuma: buffers are mapped PROT_NONE (so that
+// mlockall does not fault them in yet), bound with mbind and only then made
+// writable and touched. MPOL_MF_MOVE migrates any page already there.
+#define MPOL_BIND 2
+#define MPOL_MF_STRICT (1 << 0)
+#define MPOL_MF_MOVE (1 << 1)
+
+static int bind_to_node(void *p, size_t size, int node) {
+	unsigned long mask[16];
+	const int bits = 8 * sizeof(unsigned long);
+	if (node < 0 || node >= 16 * bits) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(mask, 0, sizeof(mask));
+	mask[node / bits] = 1UL << (node % bits);
+	return (int)syscall(SYS_mbind, p, size, MPOL_BIND, mask, 16 * bits,
+	                    MPOL_MF_STRICT | MPOL_MF_MOVE);
+}
+
+// Node of the page at p (-1 if not known)
+static int node_of(void *p) {
+	int status = -1;
+	if (syscall(SYS_move_pages, 0, 1, &p, NULL, &status, 0) != 0) {
+		return -1;
+	}
+	return status;
+}
+
+// Page backing of the buffers: 4 KiB pages, transparent huge pages
+// (madvise) or 2 MiB / 1 GiB hugetlbfs pages (MAP_HUGETLB, which must be
+// reserved in /proc/sys/vm/nr_hugepages)
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+enum page_mode { PAGES_4K, PAGES_THP, PAGES_2M, PAGES_1G };
+static const char *page_mode_names[] = {"4k", "thp", "2m", "1g"};
+static enum page_mode page_mode = PAGES_4K;
+
+static size_t page_size_of(enum page_mode mode) {
+	switch (mode) {
+	case PAGES_THP:
+	case PAGES_2M:
+		return (size_t)2 << 20;
+	case PAGES_1G:
+		return (size_t)1 << 30;
+	default:
+		return 4096;
+	}
+}
+
+static int parse_page_mode(const char *name) {
+	for (int mode = PAGES_4K; mode <= PAGES_1G; mode++) {
+		if (strcmp(name, page_mode_names[mode]) == 0) {
+			page_mode = (enum page_mode)mode;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// AnonHugePages (kB) of the mapping holding p, from /proc/self/smaps
+// (-1 if not found)
+static long thp_kb(void *p) {
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (!f) {
+		return -1;
+	}
+	char line[256];
+	int inside = 0;
+	long kb = -1;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long lo, hi;
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			inside = (uintptr_t)p >= lo && (uintptr_t)p < hi;
+		} else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+// size bytes, 64 B aligned, on node (anywhere if node < 0) and backed by
+// page_mode pages. Without either it is a plain posix_memalign.
+static void *alloc_buffer(size_t size, int node) {
+	void *p = NULL;
+	if (node < 0 && page_mode == PAGES_4K) {
+		return (posix_memalign(&p, 64, size) == 0) ? p : NULL;
+	}
+	const size_t page = page_size_of(page_mode);
+	const size_t len = (size + page - 1) / page * page;
+	size_t map_len = len;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (page_mode == PAGES_2M) {
+		flags |= MAP_HUGETLB | MAP_HUGE_2MB;
+	} else if (page_mode == PAGES_1G) {
+		flags |= MAP_HUGETLB | MAP_HUGE_1GB;
+	} else if (page_mode == PAGES_THP) {
+		map_len += page; // room to align to a huge page
+	}
+	// PROT_NONE until the policies are set, see above
+	char *m = mmap(NULL, map_len, PROT_NONE, flags, -1, 0);
+	if (m == MAP_FAILED) {
+		if (flags & MAP_HUGETLB) {
+			fprintf(stderr, "no %s huge pages for %zu B (see /proc/sys/vm/nr_hugepages)\n",
+			        page_mode_names[page_mode], len);
+		}
+		return NULL;
+	}
+	if (map_len != len) {
+		char *aligned = (char *)(((uintptr_t)m + page - 1) & ~(uintptr_t)(page - 1));
+		if (aligned != m) {
+			munmap(m, aligned - m);
+		}
+		if (aligned + len != m + map_len) {
+			munmap(aligned + len, m + map_len - (aligned + len));
+		}
+		m = aligned;
+		if (madvise(m, len, MADV_HUGEPAGE) != 0) {
+			fprintf(stderr, "warning: madvise(MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+		}
+	}
+	if (node >= 0 && bind_to_node(m, len, node) != 0) {
+		fprintf(stderr, "warning: mbind to node %d failed: %s\n", node, strerror(errno));
+	}
+	if (mprotect(m, len, PROT_READ | PROT_WRITE) != 0) {
+		munmap(m, len);
+		return NULL;
+	}
+	memset(m, 0, len);
+	if (node >= 0) {
+		int actual = node_of(m);
+		if (actual != node) {
+			fprintf(stderr, "warning: buffer wanted on node %d is on node %d\n", node, actual);
+		}
+	}
+	if (page_mode == PAGES_THP) {
+		long kb = thp_kb(m);
+		if (kb >= 0 && (size_t)kb * 1024 < len) {
+			fprintf(stderr, "warning: only %ld of %zu kB are transparent huge pages\n",
+			        kb, len / 1024);
+		}
+	}
+	return m;
+}
+
+static void free_buffer(void *p, size_t size, int node) {
+	const size_t page = page_size_of(page_mode);
+	if (node < 0 && page_mode == PAGES_4K) {
+		free(p);
+	} else {
+		munmap(p, (size + page - 1) / page * page);
+	}
+}
+
+#endif
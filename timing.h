@@ -0,0 +1,265 @@
+// timing.h
+// Measurement core shared by memtest_allsizes.c and dram_row_policy.c:
+// serialized TSC reads, cache line flushes, timer overhead and TSC frequency
+// calibration, the latency histogram and adaptive repetition.
+// Everything is static so each benchmark stays a single translation unit.
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <cpuid.h>
+
+// Flush one cache line containing p
+static inline void clflush_line(void *p) {
+	asm volatile("clflush (%0)" :: "r"(p));
+}
+
+// Serialize + rdtsc
+static inline uint64_t rdtsc_start(void) {
+	unsigned hi, lo;
+	asm volatile(
+	    "cpuid\n\t"
+	    "rdtsc\n\t"
+	    : "=a"(lo), "=d"(hi)
+	    : "a"(0)
+	    : "rbx", "rcx");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// rdtscp + serialize
+static inline uint64_t rdtsc_end(void) {
+	unsigned hi, lo;
+	asm volatile(
+	    "rdtscp\n\t"
+	    "mov %%eax, %0\n\t"
+	    "mov %%edx, %1\n\t"
+	    "cpuid\n\t"
+	    : "=r"(lo), "=r"(hi)
+	    :
+	    : "rax", "rbx", "rcx", "rdx");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// rdtscp + lfence: waits for earlier loads and keeps later ones from
+// starting, without cpuid (which traps under a hypervisor), for time series
+// where the read itself must be cheap
+static inline uint64_t rdtsc_fenced(void) {
+	unsigned hi, lo;
+	asm volatile(
+	    "rdtscp\n\t"
+	    "lfence\n\t"
+	    : "=a"(lo), "=d"(hi)
+	    :
+	    : "rcx", "memory");
+	return ((uint64_t)hi << 32) | lo;
+}
+
+// flush entire buffer by 64B steps
+static inline void flush_buffer(void *buf, size_t size) {
+	const size_t line = 64;
+	volatile char *p = (volatile char *)buf;
+	for (size_t off = 0; off < size; off += line) {
+		clflush_line((void *)(p + off));
+	}
+	// ensure flush visible
+	asm volatile("mfence" ::: "memory");
+}
+
+// Latency histogram {{{
+// HDR-style log-linear buckets, recorded in O(1) inside a measurement loop:
+// values below 256 are exact and every power of two above gets 128 buckets,
+// so a percentile (reported at its bucket midpoint) is off by 0.4% at most.
+// min, max, mean and std are exact.
+#define HIST_SUB_BITS 7
+#define HIST_LINEAR (2 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_LINEAR + (64 - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS))
+
+struct histogram {
+	uint64_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t min, max;
+	long double sum, sum_squares;
+};
+
+static inline void hist_reset(struct histogram *h) {
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+static inline void hist_record(struct histogram *h, uint64_t v) {
+	size_t i = v;
+	if (v >= HIST_LINEAR) {
+		int e = 63 - __builtin_clzll(v); // >= HIST_SUB_BITS + 1
+		i = HIST_LINEAR + (size_t)(e - HIST_SUB_BITS - 1) * (1 << HIST_SUB_BITS) +
+		    (size_t)(v >> (e - HIST_SUB_BITS)) - (1 << HIST_SUB_BITS);
+	}
+	h->counts[i]++;
+	h->total++;
+	h->min = (v < h->min) ? v : h->min;
+	h->max = (v > h->max) ? v : h->max;
+	h->sum += (long double)v;
+	h->sum_squares += (long double)v * (long double)v;
+}
+
+// Midpoint of bucket i
+static inline uint64_t hist_value(size_t i) {
+	if (i < HIST_LINEAR) {
+		return i;
+	}
+	size_t k = i - HIST_LINEAR;
+	int shift = (int)(k >> HIST_SUB_BITS) + 1;
+	uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) + (k & ((1 << HIST_SUB_BITS) - 1))) << shift;
+	return low + (((uint64_t)1 << shift) - 1) / 2;
+}
+
+// Value of the rank-th (1..total) smallest recording, clamped to the exact
+// min and max
+static inline uint64_t hist_rank(const struct histogram *h, uint64_t rank) {
+	uint64_t seen = 0;
+	rank = (rank < 1) ? 1 : (rank > h->total) ? h->total : rank;
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			uint64_t v = hist_value(i);
+			return (v < h->min) ? h->min : (v > h->max) ? h->max : v;
+		}
+	}
+	return h->max;
+}
+
+// p-th percentile (0..100)
+static inline uint64_t hist_percentile(const struct histogram *h, double p) {
+	return hist_rank(h, (uint64_t)ceil(p / 100.0 * (double)h->total));
+}
+
+// Half width of the 95% confidence interval of the median relative to the
+// median. Distribution free: the bounds are the order statistics
+// n/2 -+ 1.96 sqrt(n)/2, so outliers only move it by their rank, never by
+// their value.
+static inline double hist_median_ci(const struct histogram *h) {
+	double n = (double)h->total;
+	double half = 1.96 * sqrt(n) / 2.0;
+	uint64_t lo = hist_rank(h, (uint64_t)floor(n / 2.0 - half));
+	uint64_t hi = hist_rank(h, (uint64_t)ceil(n / 2.0 + half));
+	uint64_t median = hist_percentile(h, 50);
+	return (median == 0) ? 0.0 : (double)(hi - lo) / 2.0 / (double)median;
+}
+// }}}
+
+// Calibration {{{
+// Cycles of an empty rdtsc_start()/rdtsc_end() pair (median of 10000), to be
+// subtracted from every timed region
+static uint64_t timer_overhead(void) {
+	static uint64_t overhead = UINT64_MAX;
+	if (overhead == UINT64_MAX) {
+		static struct histogram h;
+		hist_reset(&h);
+		for (int i = 0; i < 10000; i++) {
+			uint64_t t0 = rdtsc_start();
+			uint64_t t1 = rdtsc_end();
+			hist_record(&h, t1 - t0);
+		}
+		overhead = hist_percentile(&h, 50);
+	}
+	return overhead;
+}
+
+// Cycles of a timed region without the timer overhead
+static inline uint64_t elapsed(uint64_t t0, uint64_t t1) {
+	uint64_t cycles = t1 - t0;
+	return (cycles > timer_overhead()) ? cycles - timer_overhead() : 0;
+}
+
+// Whether the TSC ticks at a constant rate through P-/C-state changes
+// (CPUID 0x80000007 EDX bit 8); without it cycles are not time
+static int tsc_invariant(void) {
+	unsigned a, b, c, d;
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) {
+		return 0;
+	}
+	return (d >> 8) & 1;
+}
+
+// TSC ticks per second: from CPUID leaf 0x15 when it reports the crystal
+// clock, else measured against CLOCK_MONOTONIC_RAW over 200 ms. source (if
+// not NULL) tells which.
+static double tsc_hz_from(const char **source) {
+	static double hz = 0.0;
+	static const char *from = "";
+	if (hz == 0.0) {
+		unsigned denominator, numerator, crystal, d;
+		if (__get_cpuid(0x15, &denominator, &numerator, &crystal, &d) &&
+		    denominator != 0 && numerator != 0 && crystal != 0) {
+			hz = (double)crystal * numerator / denominator;
+			from = "cpuid 0x15";
+		} else {
+			struct timespec a, b;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &a);
+			uint64_t t0 = rdtsc_start();
+			do {
+				clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+			} while ((b.tv_sec - a.tv_sec) * 1000000000L + (b.tv_nsec - a.tv_nsec) < 200000000L);
+			uint64_t t1 = rdtsc_end();
+			double ns = (double)(b.tv_sec - a.tv_sec) * 1e9 + (double)(b.tv_nsec - a.tv_nsec);
+			hz = (double)(t1 - t0) * 1e9 / ns;
+			from = "measured";
+		}
+	}
+	if (source) {
+		*source = from;
+	}
+	return hz;
+}
+
+static double tsc_hz(void) {
+	return tsc_hz_from(NULL);
+}
+
+static inline double cycles_to_ns(long double cycles) {
+	return (double)(cycles * 1e9L / tsc_hz());
+}
+
+// Prints the calibration a run's numbers depend on
+static void print_calibration(void) {
+	const char *source;
+	double hz = tsc_hz_from(&source);
+	printf("TSC: %.3f GHz (%s)%s, timer overhead %" PRIu64 " cycles (subtracted)\n",
+	       hz / 1e9, source, tsc_invariant() ? "" : ", NOT invariant", timer_overhead());
+}
+// }}}
+
+// Adaptive repetition {{{
+// A measurement runs in batches until the median's confidence interval is
+// within ci_target of the median, at least min_reps and at most max_reps
+// times or for budget_ns, whichever stops it first.
+struct adaptive {
+	size_t min_reps;
+	size_t max_reps;
+	size_t batch;
+	double ci_target; // relative half width, 0: always run max_reps
+	double budget_ns;
+};
+
+// Whether to stop after reps repetitions that took since_cycles so far
+static inline int adaptive_done(const struct adaptive *a, const struct histogram *h,
+                                size_t reps, uint64_t since_cycles) {
+	if (reps >= a->max_reps) {
+		return 1;
+	}
+	if (reps < a->min_reps) {
+		return 0;
+	}
+	if (cycles_to_ns(since_cycles) >= a->budget_ns) {
+		return 1;
+	}
+	return a->ci_target > 0 && hist_median_ci(h) <= a->ci_target;
+}
+// }}}
+
+#endif